@@ -7,8 +7,7 @@
 App::App(int argc, char* args[])
     : camera(ta::vec3(390.f, 0.f, 0.f), ta::vec3(0.f, 0.f, 0.f),
              ta::vec3(0.f, 1.f, 0.f)),
-      pool(12u),
-      engine_(16) {
+      engine_(scheduler_, 16) {
   ta::vec2i screen_size{1280, 720};
   try {
     glfwext::init();  // init GLFW3
@@ -18,6 +17,7 @@ App::App(int argc, char* args[])
     glewext::init();         // init glew
     engine_.init(screen_size.x(), screen_size.y());
     engine_.viewport(0, 0, screen_size.x(), screen_size.y());
+    engine_.shading_mode(engine::Engine::ShadingMode::kGouraud);
   } catch (std::exception& e) {
     std::cerr << e.what() << std::endl;
   }
@@ -46,6 +46,20 @@ App::App(int argc, char* args[])
         if (key == GLFW_KEY_ESCAPE) window->set_should_close(true);
       };
 
+  // V switches between Gouraud shading and per pixel shading at a variable
+  // rate of up to 4x4 pixels
+  window->key_press +=
+      [this](glfwext::Window* window, int key, int scancode, int mode) {
+        if (key != GLFW_KEY_V) return;
+
+        using Engine = engine::Engine;
+        variable_rate_ = !variable_rate_;
+        engine_.shading_mode(variable_rate_ ? Engine::ShadingMode::kPixel
+                                            : Engine::ShadingMode::kGouraud);
+        engine_.shading_rate(variable_rate_ ? Engine::ShadingRate::k4x4
+                                            : Engine::ShadingRate::k1x1);
+      };
+
   window->scroll +=
       [this](glfwext::Window* window, float xoffset, float yoffset) {
         if (!mouse_input) return;
@@ -71,7 +85,21 @@ App::App(int argc, char* args[])
   };
 
   std::string_view filename("/home/rayesus/workshop/hyperion.stl");
-  model.load_from_file(filename);
+  if (argc > 1) filename = args[1];
+
+  // page files are streamed, see engine::PagedMesh::build
+  if (filename.ends_with(".pages")) {
+    std::size_t cache_mb = 1024;
+    try {
+      if (argc > 2) cache_mb = std::stoul(args[2]);
+    } catch (std::logic_error&) {
+      throw std::invalid_argument("Invalid cache size " +
+                                  std::string(args[2]));
+    }
+    model.load_paged(filename, cache_mb << 20);
+  } else
+    // the window opens right away and shows the model while it loads
+    loading_ = model.load_async(filename);
   // model.rotare(ta::vec3(1.f, 0.f, 0.f), ta::rad(90.f));
 }
 
@@ -93,6 +121,10 @@ class MainShader : public engine::IShader {
     return transform * ta::vec4(pos, 1.f);
   }
   ta::vec4 Fragment() override { return ta::vec4(); }
+
+  std::uint64_t state_hash() const noexcept override {
+    return engine::hash_value(transform);
+  }
 };
 
 ta::mat4 MainShader::transform;
@@ -114,19 +146,36 @@ void App::run() {
         1000.f;
     time = tp;
 
+    if (loading_.valid() && loading_.wait_for(std::chrono::seconds(0)) ==
+                                std::future_status::ready) {
+      try {
+        loading_.get();
+      } catch (std::exception& e) {
+        std::cerr << e.what() << std::endl;
+      }
+      loading_ = {};
+    }
+
     movement(frame_time);
 
     auto projection =
         ta::perspective(ta::rad(fovy), window->ratio(), .1f, 500.f);
     auto view = camera.get_view();
 
-    // reset engine state
-    engine_.reset();
+    engine_.begin_frame();
 
     // draw model
     MainShader::transform = projection * view * model.mat4();
     engine_(model, &shader, camera.position());
 
+    if (!engine_.render()) {
+      // nothing changed since the last frame, sleep until input arrives
+      glfwWaitEventsTimeout(0.1);
+      // the wait is not part of the next frame's movement step
+      time = std::chrono::steady_clock::now();
+      continue;
+    }
+
     // draw to opengl context
     engine_.display();
 
@@ -6,6 +6,7 @@
 #include <chrono>
 #include <cmath>
 #include <format>
+#include <future>
 #include <iostream>
 #include <memory>
 #include <numeric>
@@ -19,7 +20,6 @@
 #include <glewext/glewext.hpp>
 #include <glfwext/Window.hpp>
 #include <glfwext/glfwext.hpp>
-#include <threadpool/threadpool.hpp>
 #include <tinyalgebra/Camera.hpp>
 #include <tinyalgebra/math/math.hpp>
 
@@ -27,6 +27,7 @@
 #include "ScreenBuffer/ScreenBuffer.hpp"
 
 #include "Engine/Engine.hpp"
+#include "Engine/Scheduler.hpp"
 
 class App {
  public:
@@ -38,15 +39,17 @@ class App {
  private:
   void movement(float t) noexcept;
 
-  threadpool::threadpool pool;
+  engine::Scheduler scheduler_;
 
   std::unique_ptr<glfwext::Window> window;
 
   bool mouse_input{false};
+  bool variable_rate_{false};
   float lastX, lastY;
   float fovy{90.f};
 
   engine::Model model;
+  std::shared_future<void> loading_;
   ta::Camera camera;
 
   engine::Engine engine_;
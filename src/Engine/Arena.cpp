@@ -0,0 +1,54 @@
+#include "Arena.hpp"
+
+#include <algorithm>
+
+namespace engine {
+
+Arena::Arena(std::size_t block_size)
+    : block_idx_(0),
+      offset_(0),
+      block_size_(block_size),
+      blocks_allocated_(0) {}
+
+Arena::~Arena() {}
+
+void* Arena::allocate(std::size_t size, std::size_t align) {
+  for (; block_idx_ < blocks_.size(); block_idx_++, offset_ = 0) {
+    auto&& block = blocks_[block_idx_];
+    auto base = reinterpret_cast<std::uintptr_t>(block.data.get());
+    auto ptr = (base + offset_ + align - 1) & ~(std::uintptr_t(align) - 1);
+    if (ptr + size <= base + block.size) {
+      offset_ = ptr + size - base;
+      return reinterpret_cast<void*>(ptr);
+    }
+  }
+
+  // oversized requests get a dedicated block, it is reused next frame
+  auto block_size = std::max(block_size_, size + align);
+  blocks_.push_back(
+      {std::make_unique_for_overwrite<std::byte[]>(block_size), block_size});
+  blocks_allocated_++;
+
+  block_idx_ = blocks_.size() - 1;
+  auto base = reinterpret_cast<std::uintptr_t>(blocks_.back().data.get());
+  auto ptr = (base + align - 1) & ~(std::uintptr_t(align) - 1);
+  offset_ = ptr + size - base;
+  return reinterpret_cast<void*>(ptr);
+}
+
+void Arena::reset() noexcept {
+  block_idx_ = 0;
+  offset_ = 0;
+}
+
+std::size_t Arena::blocks_allocated() const noexcept {
+  return blocks_allocated_;
+}
+
+std::size_t Arena::capacity() const noexcept {
+  std::size_t result = 0;
+  for (auto&& block : blocks_) result += block.size;
+  return result;
+}
+
+}  // namespace engine
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace engine {
+
+// Linear allocator for transient per-frame data. Memory is taken from the
+// heap in blocks which are kept across frames, so reset() is O(1) and a frame
+// that fits into the blocks of the previous ones does not touch the heap.
+// Objects are never destroyed, only trivially destructible types are allowed.
+class Arena final {
+ public:
+  explicit Arena(std::size_t block_size = std::size_t(1) << 20);
+  ~Arena();
+
+  Arena(const Arena&) = delete;
+  Arena(Arena&&) noexcept = default;
+
+  Arena& operator=(const Arena&) = delete;
+  Arena& operator=(Arena&&) noexcept = default;
+
+  void* allocate(std::size_t size, std::size_t align);
+
+  template <typename T>
+  T* allocate(std::size_t count = 1) {
+    static_assert(std::is_trivially_destructible_v<T>,
+                  "Arena never runs destructors");
+    return static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+  }
+
+  // Releases everything allocated since the previous reset, keeps blocks.
+  void reset() noexcept;
+
+  // Number of blocks requested from the heap since construction.
+  std::size_t blocks_allocated() const noexcept;
+  // Total size of the owned blocks.
+  std::size_t capacity() const noexcept;
+
+ private:
+  struct Block {
+    std::unique_ptr<std::byte[]> data;
+    std::size_t size;
+  };
+
+  std::vector<Block> blocks_;
+  std::size_t block_idx_;
+  std::size_t offset_;
+  std::size_t block_size_;
+  std::size_t blocks_allocated_;
+};
+
+}  // namespace engine
@@ -0,0 +1,110 @@
+#include "DepthTile.hpp"
+
+#include <algorithm>
+#include <limits>
+
+namespace engine {
+
+namespace {
+
+constexpr float kFar = std::numeric_limits<float>::max();
+
+}  // namespace
+
+DepthTile::DepthTile(std::size_t size)
+    : size_(size), slots_(size * size), depth_(size * size) {}
+
+void DepthTile::reset(const ScreenRect& tile) {
+  tile_ = tile;
+  compressed_ = true;
+  refs_.fill(0);
+  refs_[0] = static_cast<std::uint32_t>(tile.area());
+  std::ranges::fill(slots_, std::uint8_t(0));
+}
+
+float DepthTile::zmin() const noexcept {
+  if (!compressed_) return zmin_;
+
+  auto result = kFar;
+  for (std::size_t slot = 1; slot <= kMaxPlanes; slot++)
+    if (refs_[slot])
+      result = std::min(result, planes_[slot - 1].min(tile_));
+  return result;
+}
+
+float DepthTile::zmax() const noexcept {
+  if (!compressed_) return zmax_;
+  if (refs_[0]) return kFar;
+
+  auto result = std::numeric_limits<float>::lowest();
+  for (std::size_t slot = 1; slot <= kMaxPlanes; slot++)
+    if (refs_[slot])
+      result = std::max(result, planes_[slot - 1].max(tile_));
+  return result;
+}
+
+void DepthTile::begin(const DepthPlane& plane, bool nearer) noexcept {
+  plane_ = plane;
+  nearer_ = nearer;
+  current_ = 0;
+}
+
+bool DepthTile::test(std::int32_t x, std::int32_t y) noexcept {
+  auto idx = index(x, y);
+  auto z = plane_.at(x, y);
+
+  if (!compressed_) {
+    if (!nearer_ && z >= depth_[idx]) return false;
+    depth_[idx] = z;
+    zmin_ = std::min(zmin_, z);
+    return true;
+  }
+
+  auto slot = slots_[idx];
+  if (!nearer_ && z >= (slot ? planes_[slot - 1].at(x, y) : kFar))
+    return false;
+
+  if (!current_) {
+    for (std::uint8_t free = 1; free <= kMaxPlanes && !current_; free++)
+      if (!refs_[free]) {
+        current_ = free;
+        planes_[free - 1] = plane_;
+      }
+
+    if (!current_) {
+      decompress();
+      depth_[idx] = z;
+      zmin_ = std::min(zmin_, z);
+      return true;
+    }
+  }
+
+  refs_[slot]--;
+  refs_[current_]++;
+  slots_[idx] = current_;
+  return true;
+}
+
+bool DepthTile::compressed() const noexcept { return compressed_; }
+
+void DepthTile::decompress() noexcept {
+  zmin_ = kFar;
+  zmax_ = std::numeric_limits<float>::lowest();
+  for (auto y = tile_.ymin; y <= tile_.ymax; y++)
+    for (auto x = tile_.xmin; x <= tile_.xmax; x++) {
+      auto idx = index(x, y);
+      auto slot = slots_[idx];
+      auto z = slot ? planes_[slot - 1].at(x, y) : kFar;
+      depth_[idx] = z;
+      zmin_ = std::min(zmin_, z);
+      zmax_ = std::max(zmax_, z);
+    }
+  compressed_ = false;
+}
+
+std::size_t DepthTile::index(std::int32_t x, std::int32_t y) const noexcept {
+  return static_cast<std::size_t>(y - tile_.ymin) * size_ +
+         static_cast<std::size_t>(x - tile_.xmin);
+}
+
+}  // namespace engine
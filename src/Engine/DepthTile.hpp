@@ -0,0 +1,71 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Utility.hpp"
+
+namespace engine {
+
+// Depth buffer of the tile being rasterized. A tile is cleared and drawn to
+// the end by one job, so depth never has to outlive it.
+//
+// While at most kMaxPlanes triangles are visible in the tile, it stores their
+// depth planes and one plane index per pixel; the depth of a pixel is its
+// plane evaluated there. A triangle that needs a further plane expands the
+// tile to one float per pixel. The depth range of the tile is known without
+// touching pixels, so triangles behind everything drawn so far are rejected
+// as a whole and triangles in front of it skip the depth compare.
+class DepthTile final {
+ public:
+  static constexpr std::size_t kMaxPlanes = 2;
+
+  // size is the side of a tile in pixels
+  explicit DepthTile(std::size_t size = 0);
+
+  // Clears the tile to the far depth.
+  void reset(const ScreenRect& tile);
+
+  // Conservative bounds of the depth stored in the tile.
+  float zmin() const noexcept;
+  float zmax() const noexcept;
+
+  // Starts the pixels of a triangle; test() uses its plane until the next
+  // begin(). When the triangle is known to be nearer than zmin() its pixels
+  // pass without being compared.
+  void begin(const DepthPlane& plane, bool nearer = false) noexcept;
+
+  // Depth test of a pixel of the current triangle, stores its depth and
+  // returns true when it is nearer.
+  bool test(std::int32_t x, std::int32_t y) noexcept;
+
+  bool compressed() const noexcept;
+
+ private:
+  void decompress() noexcept;
+  std::size_t index(std::int32_t x, std::int32_t y) const noexcept;
+
+  std::size_t size_;
+  ScreenRect tile_;
+  bool compressed_{true};
+
+  std::array<DepthPlane, kMaxPlanes> planes_;
+  // pixels per slot; slot 0 is the far depth, slot i + 1 is planes_[i]
+  std::array<std::uint32_t, kMaxPlanes + 1> refs_;
+  std::vector<std::uint8_t> slots_;
+
+  std::vector<float> depth_;
+  // zmax_ is conservative while decompressed, it is not lowered by nearer
+  // pixels
+  float zmin_;
+  float zmax_;
+
+  DepthPlane plane_;
+  bool nearer_{false};
+  // slot of the current triangle, 0 until one of its pixels passed
+  std::uint8_t current_{0};
+};
+
+}  // namespace engine
@@ -1,10 +1,15 @@
 #include "Engine.hpp"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <cmath>
 #include <limits>
-#include <map>
+#include <memory>
 #include <numeric>
 #include <stdexcept>
+#include <tuple>
+#include <utility>
 
 #include <format>
 #include <iostream>
@@ -12,27 +17,29 @@
 #include <tinyalgebra/math/math.hpp>
 
 namespace engine {
-Engine::Engine(std::size_t tile_size) : tile_size_(tile_size), pool_(10) {}
-
-Engine::Engine(std::size_t width, std::size_t height, std::size_t tile_size)
+Engine::Engine(Scheduler& scheduler, std::size_t tile_size)
     : tile_size_(tile_size),
-      screen_size_(static_cast<int>(width), static_cast<int>(height)),
-      zbuffer_(width * height, std::numeric_limits<float>::max()),
-      screen_points_buffer_(width * height * 2),
-      color_buffer_(width * height * 3, .7f),
-      pool_(10) {
-  zgrid_ = mdspan<float, 2>(zbuffer_.data(), height, width);
+      arenas_(scheduler.concurrency()),
+      depth_tiles_(scheduler.concurrency(), DepthTile(tile_size)),
+      scheduler_(scheduler) {}
+
+Engine::Engine(Scheduler& scheduler, std::size_t width, std::size_t height,
+               std::size_t tile_size)
+    : Engine(scheduler, tile_size) {
+  init(width, height);
+}
 
-  auto sp_grid_ = mdspan<float, 3>(screen_points_buffer_.data(), height, width,
-                                   std::size_t(2));
-  for (std::size_t i = 0; i < height; i++)
-    for (std::size_t j = 0; j < width; j++) {
-      sp_grid_[i][j][0] = 2.f * j / width - 1.f;
-      sp_grid_[i][j][1] = 2.f * i / height - 1.f;
-    }
+Engine::~Engine() {
+  // headless engines never created GL objects
+  if (!VAO) return;
 
-  colors_ = mdspan<float, 3>(color_buffer_.data(), height, width,
-                             static_cast<std::size_t>(3));
+  glDeleteVertexArrays(1, &VAO);
+  glDeleteBuffers(1, &VBOPos);
+  glDeleteBuffers(1, &VBOCol);
+}
+
+void Engine::init(std::size_t width, std::size_t height) {
+  allocate_buffers(width, height);
 
   glGenVertexArrays(1, &VAO);
   glBindVertexArray(VAO);
@@ -63,69 +70,31 @@ Engine::Engine(std::size_t width, std::size_t height, std::size_t tile_size)
   shader_ = std::make_unique<glewext::Shader>(vshader, fshader);
 }
 
-Engine::~Engine() {
-  glDeleteVertexArrays(1, &VAO);
-  glDeleteBuffers(1, &VBOPos);
-  glDeleteBuffers(1, &VBOCol);
-}
-
-void Engine::init(std::size_t width, std::size_t height) {
-  screen_size_ =
-      std::make_tuple(static_cast<int>(width), static_cast<int>(height));
-  zbuffer_ =
-      std::vector<float>(width * height, std::numeric_limits<float>::max());
-  screen_points_buffer_ = std::vector<float>(width * height * 2);
-  color_buffer_ = std::vector<float>(width * height * 3, 0.7f);
-
-  zgrid_ = mdspan<float, 2>(zbuffer_.data(), height, width);
-
-  auto sp_grid_ = mdspan<float, 3>(screen_points_buffer_.data(), height, width,
-                                   std::size_t(2));
-  for (std::size_t i = 0; i < height; i++)
-    for (std::size_t j = 0; j < width; j++) {
-      sp_grid_[i][j][0] = 2.f * j / width - 1.f;
-      sp_grid_[i][j][1] = 2.f * i / height - 1.f;
-    }
-
-  colors_ = mdspan<float, 3>(color_buffer_.data(), height, width,
-                             static_cast<std::size_t>(3));
+void Engine::resize(std::size_t width, std::size_t height) {
+  allocate_buffers(width, height);
+  if (!VAO) return;
 
-  glGenVertexArrays(1, &VAO);
   glBindVertexArray(VAO);
 
-  glGenBuffers(1, &VBOPos);
   glBindBuffer(GL_ARRAY_BUFFER, VBOPos);
   glBufferData(GL_ARRAY_BUFFER, screen_points_buffer_.size() * sizeof(float),
                screen_points_buffer_.data(), GL_STATIC_DRAW);
 
-  glVertexAttribPointer(0, 2, GL_FLOAT, GL_TRUE, 0, nullptr);
-  glEnableVertexAttribArray(0);
-
-  glGenBuffers(1, &VBOCol);
   glBindBuffer(GL_ARRAY_BUFFER, VBOCol);
   glBufferData(GL_VERTEX_ARRAY, color_buffer_.size() * sizeof(float),
                color_buffer_.data(), GL_STREAM_DRAW);
 
-  glVertexAttribPointer(1, 3, GL_FLOAT, GL_TRUE, 0, nullptr);
-  glEnableVertexAttribArray(1);
-
   glBindVertexArray(0);
-
-  std::string_view vshader(
-      "/home/rayesus/workshop/3d-render/resources/glsl/main.vert");
-  std::string_view fshader(
-      "/home/rayesus/workshop/3d-render/resources/glsl/main.frag");
-
-  shader_ = std::make_unique<glewext::Shader>(vshader, fshader);
 }
 
-void Engine::resize(std::size_t width, std::size_t height) {
-  zbuffer_ =
-      std::vector<float>(width * height, std::numeric_limits<float>::max());
+void Engine::allocate_buffers(std::size_t width, std::size_t height) {
+  screen_size_ =
+      std::make_tuple(static_cast<int>(width), static_cast<int>(height));
+  frame_valid_ = false;
   screen_points_buffer_ = std::vector<float>(width * height * 2);
   color_buffer_ = std::vector<float>(width * height * 3, 0.7f);
 
-  zgrid_ = mdspan<float, 2>(zbuffer_.data(), height, width);
+  update_tiles();
 
   auto sp_grid_ = mdspan<float, 3>(screen_points_buffer_.data(), height, width,
                                    std::size_t(2));
@@ -137,24 +106,25 @@ void Engine::resize(std::size_t width, std::size_t height) {
 
   colors_ = mdspan<float, 3>(color_buffer_.data(), height, width,
                              static_cast<std::size_t>(3));
+}
 
-  glBindVertexArray(VAO);
+void Engine::update_tiles() {
+  auto&& [width, height] = screen_size_;
+  auto ts = static_cast<std::int32_t>(tile_size_);
+  tiles_x_ = (width + ts - 1) / ts;
+  tiles_y_ = (height + ts - 1) / ts;
 
-  glBindBuffer(GL_ARRAY_BUFFER, VBOPos);
-  glBufferData(GL_ARRAY_BUFFER, screen_points_buffer_.size() * sizeof(float),
-               screen_points_buffer_.data(), GL_STATIC_DRAW);
-
-  glBindBuffer(GL_ARRAY_BUFFER, VBOCol);
-  glBufferData(GL_VERTEX_ARRAY, color_buffer_.size() * sizeof(float),
-               color_buffer_.data(), GL_STREAM_DRAW);
+  dirty_tiles_.assign(static_cast<std::size_t>(tiles_x_ * tiles_y_), 0);
+  tile_bins_.assign(dirty_tiles_.size() * geometry_jobs(), TileBin());
 
-  glBindVertexArray(0);
+  for (auto&& buffer : occlusion_) buffer.resize(width, height);
 }
 
 void Engine::reset() {
-  for (auto&& q : tile_queue_array_) q = TileQueue();
+  frame_valid_ = false;
+  last_draws_.clear();
 
-  for (auto&& z : zbuffer_) z = std::numeric_limits<float>::max();
+  for (auto&& bin : tile_bins_) bin.clear();
 
   // sequential color component
   for (auto&& scc : color_buffer_) scc = .3f;
@@ -176,136 +146,1135 @@ bool is_inside(float a0, float b0, float a1, float b1, float a2, float b2) {
   return f1 && f2 && f3;
 }
 
+namespace {
+
+ta::vec3 to_world(const ta::mat4& model, const ta::vec3& pos) {
+  return ta::vec3(model * ta::vec4(pos, 1.f));
+}
+
+// normal_matrix holds the columns of the cofactor matrix
+ta::vec3 to_world_normal(const std::array<ta::vec3, 3>& normal_matrix,
+                         const ta::vec3& normal) {
+  return ta::normalize(normal_matrix[0] * normal.x() +
+                       normal_matrix[1] * normal.y() +
+                       normal_matrix[2] * normal.z());
+}
+
+}  // namespace
+
+void Engine::begin_frame() noexcept { draws_.clear(); }
+
 void Engine::operator()(Model& model, IShader* shader,
                         const ta::vec3& camera_pos) {
-  std::map<std::size_t, ta::vec4> cache;
+  model.refresh();
+
+  auto hash = hash_value(&model);
+  hash = hash_value(model.version(), hash);
+  hash = hash_value(shader->state_hash(), hash);
+  hash = hash_value(camera_pos, hash);
+  hash = hash_value(viewport_, hash);
+
+  // cofactors of the linear part, negated for mirroring matrices so
+  // normals keep pointing outwards
+  auto matrix = model.mat4();
+  auto axis = [&](float x, float y, float z) {
+    return ta::vec3(matrix * ta::vec4(ta::vec3(x, y, z), 0.f));
+  };
+  std::array<ta::vec3, 3> axes{axis(1.f, 0.f, 0.f), axis(0.f, 1.f, 0.f),
+                               axis(0.f, 0.f, 1.f)};
+  std::array<ta::vec3, 3> normal_matrix{ta::cross(axes[1], axes[2]),
+                                        ta::cross(axes[2], axes[0]),
+                                        ta::cross(axes[0], axes[1])};
+  if (ta::dot(axes[0], normal_matrix[0]) < 0.f)
+    for (auto&& column : normal_matrix) column = -column;
+
+  draws_.push_back({&model, shader, camera_pos, hash,
+                    project(model.bounds(), shader).rect, matrix,
+                    normal_matrix});
+}
+
+Engine::ProjectedBox Engine::project(const std::array<ta::vec3, 2>& box,
+                                     IShader* shader) const {
+  auto&& [width, height] = screen_size_;
+  ScreenRect screen{0, 0, width - 1, height - 1};
+  auto&& [bmin, bmax] = box;
+
+  ProjectedBox result{ScreenRect(), std::numeric_limits<float>::max()};
+  for (std::size_t corner = 0; corner < 8; corner++) {
+    ta::vec3 pos((corner & 1) ? bmax.x() : bmin.x(),
+                 (corner & 2) ? bmax.y() : bmin.y(),
+                 (corner & 4) ? bmax.z() : bmin.z());
+    auto v = shader->Vertex(pos);
+    // the box crosses the camera plane, its projection is unbounded
+    if (v.w() <= 0.f) return {screen, std::numeric_limits<float>::lowest()};
+
+    v /= v.w();
+    auto tmp = viewport_ * v;
+    auto x = static_cast<std::int32_t>(std::floor(tmp.x()));
+    auto y = static_cast<std::int32_t>(std::floor(tmp.y()));
+    result.rect = merge(result.rect, ScreenRect{x - 1, y - 1, x + 1, y + 1});
+    result.zmin = std::min(result.zmin, v.z());
+  }
 
-  ta::vec3 light_pos(0.f, 100.f, 0.f);
-  // ta::vec3 light_color(1.f);
-  // ta::vec3 base_color(0.9f, 0.f, 0.f);
+  result.rect = intersect(result.rect, screen);
+  return result;
+}
 
-  decltype(auto) mesh = model.mesh();
+ScreenRect Engine::tiles_of(const ScreenRect& rect) const noexcept {
+  auto ts = static_cast<std::int32_t>(tile_size_);
+  return {rect.xmin / ts, rect.ymin / ts, rect.xmax / ts, rect.ymax / ts};
+}
 
-  for (std::size_t solid_idx = 0; solid_idx != mesh.num_solids(); solid_idx++) {
-    for (auto tri_idx = mesh.solid_tris_begin(solid_idx);
-         tri_idx != mesh.solid_tris_end(solid_idx); tri_idx++) {
-      std::array<ta::vec4, 3> vtcs;
-      auto a3f = mesh.tri_normal(tri_idx);
-      ta::vec3 normal(a3f[0], a3f[1], a3f[2]);
-
-      for (auto&& [idx, vclip] : vtcs | std::views::enumerate) {
-        auto vidx = mesh.tri_corner_ind(tri_idx, idx);
-        auto finder = cache.find(vidx);
-        if (finder == cache.end()) {
-          auto a3f = mesh.vrt_coords(vidx);
-          ta::vec3 v(a3f[0], a3f[1], a3f[2]);
-          vclip = shader->Vertex(v);
-          cache[vidx] = vclip;
+ScreenRect Engine::tile_rect(std::int32_t tx, std::int32_t ty) const noexcept {
+  auto&& [width, height] = screen_size_;
+  auto ts = static_cast<std::int32_t>(tile_size_);
+  return {tx * ts, ty * ts, std::min((tx + 1) * ts, width) - 1,
+          std::min((ty + 1) * ts, height) - 1};
+}
+
+bool Engine::collect_dirty_tiles() {
+  if (!frame_valid_ || draws_.size() != last_draws_.size()) {
+    std::ranges::fill(dirty_tiles_, 1);
+    return !dirty_tiles_.empty();
+  }
+
+  std::ranges::fill(dirty_tiles_, 0);
+  bool dirty = false;
+
+  for (auto&& [cur, last] : std::views::zip(draws_, last_draws_)) {
+    if (cur.hash == last.hash) continue;
+
+    for (auto&& rect : {cur.bounds, last.bounds}) {
+      if (rect.empty()) continue;
+
+      auto tiles = tiles_of(rect);
+      for (auto ty = tiles.ymin; ty <= tiles.ymax; ty++)
+        for (auto tx = tiles.xmin; tx <= tiles.xmax; tx++)
+          dirty_tiles_[ty * tiles_x_ + tx] = 1;
+      dirty = true;
+    }
+  }
+
+  return dirty;
+}
+
+void Engine::clear(Target& target, const ScreenRect& rect) {
+  for (auto y = rect.ymin; y <= rect.ymax; y++)
+    for (auto x = rect.xmin; x <= rect.xmax; x++) {
+      target.colors[y][x][0] = .3f;
+      target.colors[y][x][1] = .3f;
+      target.colors[y][x][2] = .3f;
+    }
+}
+
+bool Engine::render() {
+  if (!collect_dirty_tiles()) {
+    last_draws_.swap(draws_);
+    frame_valid_ = true;
+    return false;
+  }
+
+  targets_.clear();
+  targets_.push_back({colors_});
+  draw();
+
+  last_draws_.swap(draws_);
+  frame_valid_ = true;
+  return true;
+}
+
+void Engine::render_views(Model& model, std::span<const View> views,
+                          std::span<Image> images) {
+  if (views.size() != images.size())
+    throw std::invalid_argument("Every view needs an image");
+
+  auto&& [width, height] = screen_size_;
+  auto w = static_cast<std::size_t>(width);
+  auto h = static_cast<std::size_t>(height);
+
+  targets_.clear();
+  draws_.clear();
+  for (std::size_t view = 0; view < views.size(); view++) {
+    auto&& image = images[view];
+    image.width = w;
+    image.height = h;
+    image.color.resize(w * h * 3);
+
+    targets_.push_back(
+        {mdspan<float, 3>(image.color.data(), h, w, std::size_t(3))});
+    (*this)(model, views[view].shader, views[view].camera_pos);
+    draws_.back().view = static_cast<std::uint32_t>(view);
+  }
+
+  std::ranges::fill(dirty_tiles_, 1);
+  draw();
+  draws_.clear();
+}
+
+void Engine::draw() {
+  auto blocks_allocated = [this] {
+    std::size_t result = 0;
+    for (auto&& arena : arenas_) result += arena.blocks_allocated();
+    return result;
+  };
+  auto blocks_before = blocks_allocated();
+
+  auto&& [width, height] = screen_size_;
+  auto tiles = dirty_tiles_.size();
+  views_ = targets_.size();
+  while (occlusion_.size() < views_)
+    occlusion_.emplace_back().resize(width, height);
+
+  for (auto&& arena : arenas_) arena.reset();
+  tile_bins_.resize(geometry_jobs() * views_ * tiles);
+  for (auto&& bin : tile_bins_) bin.clear();
+  stats_.triangles = 0;
+
+  for (auto&& call : draws_) {
+    call.active = false;
+    if (call.bounds.empty()) continue;
+
+    auto rect = tiles_of(call.bounds);
+    for (auto ty = rect.ymin; ty <= rect.ymax && !call.active; ty++)
+      for (auto tx = rect.xmin; tx <= rect.xmax && !call.active; tx++)
+        call.active = dirty_tiles_[ty * tiles_x_ + tx];
+  }
+
+  // a new pin epoch of every streamed model, once even if drawn twice
+  for (auto&& [idx, call] : draws_ | std::views::enumerate) {
+    auto pages = call.model->pages();
+    auto first_use = std::ranges::none_of(
+        draws_.begin(), draws_.begin() + idx,
+        [&](auto&& other) { return other.model == call.model; });
+    if (call.active && pages && first_use) pages->begin_frame();
+  }
+
+  bind_light_caches();
+  cull();
+  transform();
+  setup();
+
+  // (view, tile) pairs, heavy ones first; a single dense tile must not
+  // start last
+  tile_order_.clear();
+  tile_cost_.assign(views_ * tiles, 0);
+  for (std::uint32_t view = 0; view < views_; view++)
+    for (std::uint32_t tile_idx = 0; tile_idx < tiles; tile_idx++) {
+      if (!dirty_tiles_[tile_idx]) continue;
+
+      auto idx = view * static_cast<std::uint32_t>(tiles) + tile_idx;
+      tile_order_.push_back(idx);
+      for (std::size_t job = 0; job < geometry_jobs(); job++)
+        tile_cost_[idx] += bins_of(job, view)[tile_idx].size;
+    }
+  std::ranges::sort(tile_order_, [this](auto a, auto b) {
+    auto ca = tile_cost_[a], cb = tile_cost_[b];
+    return ca != cb ? ca > cb : a < b;
+  });
+
+  auto tile_stats = arenas_.front().allocate<TileStats>(tile_cost_.size());
+  scheduler_.run(std::span<const std::uint32_t>(tile_order_),
+                 [&](std::size_t idx, std::size_t worker) {
+                   auto view = idx / tiles, tile_idx = idx % tiles;
+                   auto tile_pos = static_cast<std::int32_t>(tile_idx);
+                   auto tile = tile_rect(tile_pos % tiles_x_,
+                                         tile_pos / tiles_x_);
+                   clear(targets_[view], tile);
+                   tile_stats[idx] =
+                       rasterize(view, tile_idx, tile, depth_tiles_[worker]);
+                 });
+
+  stats_.fragments = 0;
+  stats_.shading_evaluations = 0;
+  stats_.tiles = tile_order_.size();
+  stats_.tiles_compressed = 0;
+  stats_.depth_rejects = 0;
+  for (auto idx : tile_order_) {
+    stats_.fragments += tile_stats[idx].fragments;
+    stats_.shading_evaluations += tile_stats[idx].shading_evaluations;
+    stats_.tiles_compressed += tile_stats[idx].compressed;
+    stats_.depth_rejects += tile_stats[idx].depth_rejects;
+  }
+
+  stats_.arena_blocks_allocated = blocks_allocated() - blocks_before;
+  stats_.arena_capacity = 0;
+  for (auto&& arena : arenas_) stats_.arena_capacity += arena.capacity();
+}
+
+const Engine::FrameStats& Engine::stats() const noexcept { return stats_; }
+
+void Engine::cull() {
+  auto&& arena = arenas_.front();
+  stats_.clusters = 0;
+  stats_.clusters_culled = 0;
+
+  // clusters of all active draws in chunks, one scheduler pass covers every
+  // view of a batch
+  struct Chunk {
+    std::uint32_t draw;
+    std::size_t first, last;
+  };
+
+  std::size_t count = 0;
+  for (auto&& call : draws_)
+    if (call.active)
+      count += (call.model->clusters().size() + kClusterGrain - 1) /
+               kClusterGrain;
+
+  auto chunks = arena.allocate<Chunk>(count);
+  std::size_t size = 0;
+  for (std::uint32_t draw = 0; draw < draws_.size(); draw++) {
+    auto&& call = draws_[draw];
+    if (!call.active) continue;
+
+    auto clusters = call.model->clusters().size();
+    call.clusters = arena.allocate<ClusterState>(clusters);
+    stats_.clusters += clusters;
+    for (std::size_t first = 0; first < clusters; first += kClusterGrain)
+      std::construct_at(chunks + size++, draw, first,
+                        std::min(first + kClusterGrain, clusters));
+  }
+
+  auto for_each_cluster = [&](auto&& f) {
+    scheduler_.run(count, [&](std::size_t idx, std::size_t) {
+      auto&& chunk = chunks[idx];
+      auto&& call = draws_[chunk.draw];
+      for (auto cluster = chunk.first; cluster < chunk.last; cluster++)
+        f(call, cluster);
+    });
+  };
+
+  for_each_cluster([&](DrawCall& call, std::size_t idx) {
+    auto box = project(call.model->clusters()[idx].bounds, call.shader);
+    // off screen or beyond the far plane
+    auto visible = !box.rect.empty() && box.zmin <= 1.f;
+    std::construct_at(call.clusters + idx, box, visible);
+  });
+
+  if (occlusion_culling_) {
+    for (std::size_t view = 0; view < views_; view++)
+      rasterize_occluders(view);
+
+    for_each_cluster([&](DrawCall& call, std::size_t idx) {
+      auto&& state = call.clusters[idx];
+      if (state.visible &&
+          occlusion_[call.view].occluded(state.box.rect, state.box.zmin))
+        state.visible = false;
+    });
+  }
+
+  // request visible pages, larger ones first; until they arrive their
+  // clusters are left out
+  for (auto&& call : draws_) {
+    if (!call.active || !call.model->streamed()) continue;
+
+    for (std::size_t idx = 0; idx < call.model->clusters().size(); idx++) {
+      auto&& state = call.clusters[idx];
+      if (!state.visible) continue;
+
+      auto priority = static_cast<float>(state.box.rect.area());
+      state.page = triangles(call, idx, priority);
+      state.visible = state.page != nullptr;
+    }
+  }
+
+  for (auto&& call : draws_) {
+    if (!call.active) continue;
+
+    auto count = call.model->clusters().size();
+    stats_.clusters_culled += static_cast<std::size_t>(std::count_if(
+        call.clusters, call.clusters + count,
+        [](auto&& state) { return !state.visible; }));
+  }
+}
+
+void Engine::rasterize_occluders(std::size_t view) {
+  struct Candidate {
+    std::int64_t area;
+    std::uint32_t draw;
+    std::uint32_t cluster;
+  };
+
+  auto&& occlusion = occlusion_[view];
+  occlusion.clear();
+
+  // clusters crossing the camera plane have an unbounded projection
+  auto is_candidate = [](auto&& state) {
+    return state.visible && state.box.rect.area() >= kOccluderMinArea &&
+           state.box.zmin > std::numeric_limits<float>::lowest();
+  };
+
+  std::size_t count = 0;
+  for (auto&& call : draws_) {
+    if (!call.active || call.view != view) continue;
+    for (std::size_t idx = 0; idx < call.model->clusters().size(); idx++)
+      count += is_candidate(call.clusters[idx]);
+  }
+  if (!count) return;
+
+  auto candidates = arenas_.front().allocate<Candidate>(count);
+  std::size_t size = 0;
+  for (std::uint32_t draw = 0; draw < draws_.size(); draw++) {
+    auto&& call = draws_[draw];
+    if (!call.active || call.view != view) continue;
+    for (std::uint32_t idx = 0; idx < call.model->clusters().size(); idx++)
+      if (is_candidate(call.clusters[idx]))
+        std::construct_at(candidates + size++,
+                          call.clusters[idx].box.rect.area(), draw, idx);
+  }
+
+  // the largest clusters on screen hide the most
+  auto selected = std::min(count, kMaxOccluders);
+  std::ranges::partial_sort(
+      candidates, candidates + selected, candidates + count,
+      [](auto&& a, auto&& b) {
+        if (a.area != b.area) return a.area > b.area;
+        return std::tie(a.draw, a.cluster) < std::tie(b.draw, b.cluster);
+      });
+
+  for (auto&& candidate : std::span(candidates, selected)) {
+    auto&& call = draws_[candidate.draw];
+    auto&& cluster = call.model->clusters()[candidate.cluster];
+    decltype(auto) mesh = call.model->mesh();
+    auto compact = call.model->compact_mesh();
+
+    const PagedTriangle* page = nullptr;
+    if (call.model->streamed()) {
+      page = triangles(call, candidate.cluster,
+                       static_cast<float>(candidate.area));
+      if (!page) continue;
+    }
+
+    for (auto tri_idx = cluster.tris_begin; tri_idx != cluster.tris_end;
+         tri_idx++) {
+      std::array<ta::vec2i, 3> screen;
+      auto zmax = std::numeric_limits<float>::lowest();
+      bool skip = false;
+
+      for (std::size_t corner = 0; corner < 3; corner++) {
+        ta::vec3 pos(0.f);
+        if (compact) {
+          auto&& packed = compact->cluster(candidate.cluster);
+          pos = compact->position(packed,
+                                  compact->corner(packed, tri_idx, corner));
         } else {
-          vclip = cache[vidx];
+          auto a3f =
+              page ? page[tri_idx].vertices[corner]
+                   : mesh.vrt_coords(mesh.tri_corner_ind(tri_idx, corner));
+          pos = ta::vec3(a3f[0], a3f[1], a3f[2]);
         }
+        auto v = call.shader->Vertex(pos);
+        // parts before the near plane may be rejected by the main pipeline
+        skip = v.w() <= 0.f || v.z() < -v.w();
+        if (skip) break;
+
+        v /= v.w();
+        zmax = std::max(zmax, v.z());
+        auto tmp = viewport_ * v;
+        screen[corner] = ta::vec2i(static_cast<std::int32_t>(tmp.x()),
+                                   static_cast<std::int32_t>(tmp.y()));
+      }
+
+      if (!skip) occlusion.rasterize(screen, zmax);
+    }
+  }
+}
+
+void Engine::bind_light_caches() {
+  for (auto&& cache : light_caches_) cache.used = false;
+  for (auto&& call : draws_) call.vertex_light = call.triangle_light = nullptr;
+  if (shading_mode_ == ShadingMode::kPixel) {
+    light_caches_.clear();
+    return;
+  }
+
+  // Lighting depends on the model and the light only, so all draws of a
+  // model share its cache. Streamed models have no stable vertices and
+  // triangles to cache.
+  auto cached = [](const DrawCall& call) { return !call.model->streamed(); };
+  auto key = [this](const DrawCall& call) {
+    auto hash = hash_value(call.model);
+    hash = hash_value(call.model->version(), hash);
+    return hash_value(light_pos_, hash);
+  };
+  auto find = [&](const DrawCall& call) {
+    return std::ranges::find_if(light_caches_, [&](auto&& cache) {
+      return cache.model == call.model && cache.key == key(call);
+    });
+  };
+  auto bind = [this](DrawCall& call, LightCache& cache) {
+    cache.used = true;
+    (shading_mode_ == ShadingMode::kGouraud ? call.vertex_light
+                                            : call.triangle_light) =
+        cache.light.data();
+  };
+
+  // models unchanged since the last frame keep their lighting, also when
+  // they are not redrawn this time
+  for (auto&& call : draws_) {
+    if (!cached(call)) continue;
+    if (auto cache = find(call); cache != light_caches_.end())
+      bind(call, *cache);
+  }
+
+  // Changed models take over stale caches; moving a cache keeps its
+  // storage. Their lighting is computed below, so caches are only read
+  // while the frame is drawn.
+  struct Rebuild {
+    const DrawCall* call;
+    float* light;
+  };
+  auto&& arena = arenas_.front();
+  auto rebuilds = arena.allocate<Rebuild>(draws_.size());
+  std::size_t count = 0, stale = 0;
+  for (auto&& call : draws_) {
+    if (!call.active || !cached(call) || call.vertex_light ||
+        call.triangle_light)
+      continue;
+
+    // another draw of the model rebuilt its cache already
+    if (auto cache = find(call); cache != light_caches_.end()) {
+      bind(call, *cache);
+      continue;
+    }
+
+    while (stale < light_caches_.size() && light_caches_[stale].used) stale++;
+    if (stale == light_caches_.size()) light_caches_.emplace_back();
+
+    auto&& model = *call.model;
+    auto&& clusters = model.clusters();
+    std::size_t size = clusters.empty() ? 0 : clusters.back().tris_end;
+    if (shading_mode_ == ShadingMode::kGouraud)
+      size = model.compact_mesh() ? model.compact_mesh()->num_vrts()
+                                  : model.mesh().num_vrts();
+
+    auto&& cache = light_caches_[stale];
+    cache.model = call.model;
+    cache.key = key(call);
+    cache.light.resize(size);
+    bind(call, cache);
+    std::construct_at(rebuilds + count++, &call, cache.light.data());
+  }
+
+  std::erase_if(light_caches_, [](auto&& cache) { return !cache.used; });
+  if (!count) return;
+
+  // Rebuilt caches in chunks: vertices of a full precision mesh for
+  // Gouraud, clusters otherwise.
+  auto gouraud = shading_mode_ == ShadingMode::kGouraud;
+  auto items = [&](const DrawCall& call)
+      -> std::pair<std::size_t, std::size_t> {
+    auto&& model = *call.model;
+    if (gouraud && !model.compact_mesh())
+      return {model.mesh().num_vrts(), kVertexGrain};
+    return {model.clusters().size(), kClusterGrain};
+  };
+
+  struct Chunk {
+    std::uint32_t rebuild;
+    std::size_t first, last;
+  };
+
+  std::size_t chunk_count = 0;
+  for (auto&& rebuild : std::span(rebuilds, count)) {
+    auto [size, grain] = items(*rebuild.call);
+    chunk_count += (size + grain - 1) / grain;
+  }
+
+  auto chunks = arena.allocate<Chunk>(chunk_count);
+  std::size_t size = 0;
+  for (std::uint32_t idx = 0; idx < count; idx++) {
+    auto [last, grain] = items(*rebuilds[idx].call);
+    for (std::size_t first = 0; first < last; first += grain)
+      std::construct_at(chunks + size++, idx, first,
+                        std::min(first + grain, last));
+  }
+
+  scheduler_.run(chunk_count, [&](std::size_t idx, std::size_t) {
+    auto&& chunk = chunks[idx];
+    auto&& [call, values] = rebuilds[chunk.rebuild];
+    auto&& model = *call->model;
+    auto compact = model.compact_mesh();
+
+    if (!gouraud) {
+      // flat: one value per triangle
+      auto&& clusters = model.clusters();
+      for (auto cluster = chunk.first; cluster < chunk.last; cluster++)
+        for (auto tri_idx = clusters[cluster].tris_begin;
+             tri_idx != clusters[cluster].tris_end; tri_idx++)
+          values[tri_idx] =
+              triangle_shading(*call, cluster, tri_idx).light[0];
+      return;
+    }
+
+    if (compact) {
+      for (auto cluster_idx = chunk.first; cluster_idx < chunk.last;
+           cluster_idx++) {
+        auto&& cluster = compact->cluster(cluster_idx);
+        for (auto vidx = cluster.vertices_begin; vidx < cluster.vertices_end;
+             vidx++)
+          values[vidx] =
+              shade(to_world(call->model_matrix,
+                             compact->position(cluster, vidx)),
+                    to_world_normal(call->normal_matrix,
+                                    compact->vertex_normal(vidx)));
+      }
+      return;
+    }
+
+    decltype(auto) mesh = model.mesh();
+    auto normals = model.vertex_normals();
+    for (auto vidx = chunk.first; vidx < chunk.last; vidx++) {
+      auto a3f = mesh.vrt_coords(vidx);
+      ta::vec3 v(a3f[0], a3f[1], a3f[2]);
+      values[vidx] = shade(to_world(call->model_matrix, v),
+                          to_world_normal(call->normal_matrix, normals[vidx]));
+    }
+  });
+}
+
+const PagedTriangle* Engine::triangles(const DrawCall& call,
+                                       std::size_t cluster, float priority) {
+  if (auto pages = call.model->pages())
+    return pages->acquire(cluster, priority);
+  return call.model->triangles(cluster);
+}
+
+void Engine::transform() {
+  auto&& arena = arenas_.front();
+  // streamed models are transformed triangle by triangle in setup
+  auto indexed = [](const DrawCall& call) {
+    return call.active && !call.model->streamed();
+  };
+
+  // Vertex ranges of all draws, transformed in one scheduler pass. Clusters
+  // of a quantized mesh own their vertices, so ranges of visible clusters
+  // are decoded; full precision meshes share vertices between clusters and
+  // the used ones are marked first.
+  struct Chunk {
+    std::uint32_t draw;
+    // clusters of a quantized mesh, vertices otherwise
+    std::size_t first, last;
+  };
+
+  std::size_t capacity = 0;
+  auto used = arena.allocate<std::uint8_t*>(draws_.size());
+  for (std::size_t draw = 0; draw < draws_.size(); draw++) {
+    auto&& call = draws_[draw];
+    if (!indexed(call)) continue;
+
+    if (auto compact = call.model->compact_mesh()) {
+      call.clip = arena.allocate<ta::vec4>(compact->num_vrts());
+      capacity += call.model->clusters().size();
+    } else {
+      auto vertices = call.model->mesh().num_vrts();
+      call.clip = arena.allocate<ta::vec4>(vertices);
+      used[draw] = arena.allocate<std::uint8_t>(vertices);
+      capacity += (vertices + kVertexGrain - 1) / kVertexGrain;
+    }
+  }
+
+  auto chunks = arena.allocate<Chunk>(capacity);
+  std::size_t count = 0;
+  for (std::uint32_t draw = 0; draw < draws_.size(); draw++) {
+    auto&& call = draws_[draw];
+    if (!indexed(call)) continue;
+
+    auto compact = call.model->compact_mesh();
+    if (!compact) {
+      auto vertices = call.model->mesh().num_vrts();
+      for (std::size_t first = 0; first < vertices; first += kVertexGrain)
+        std::construct_at(chunks + count++, draw, first,
+                          std::min(first + kVertexGrain, vertices));
+      continue;
+    }
+
+    // runs of visible clusters with about kVertexGrain vertices
+    auto clusters = call.model->clusters().size();
+    std::size_t first = 0, vertices = 0;
+    for (std::size_t idx = 0; idx < clusters; idx++) {
+      if (!call.clusters[idx].visible) continue;
+
+      if (!vertices) first = idx;
+      auto&& cluster = compact->cluster(idx);
+      vertices += cluster.vertices_end - cluster.vertices_begin;
+      if (vertices >= kVertexGrain) {
+        std::construct_at(chunks + count++, draw, first, idx + 1);
+        vertices = 0;
       }
+    }
+    if (vertices) std::construct_at(chunks + count++, draw, first, clusters);
+  }
+
+  // Used vertices of full precision meshes are cleared over the vertex
+  // chunks and marked over chunks of clusters, several clusters may mark
+  // the same vertex.
+  auto full_precision = [&](const DrawCall& call) {
+    return indexed(call) && !call.model->compact_mesh();
+  };
+  scheduler_.run(count, [&](std::size_t idx, std::size_t) {
+    auto&& chunk = chunks[idx];
+    if (full_precision(draws_[chunk.draw]))
+      std::fill(used[chunk.draw] + chunk.first, used[chunk.draw] + chunk.last,
+                std::uint8_t(0));
+  });
+
+  std::size_t marks = 0;
+  for (auto&& call : draws_)
+    if (full_precision(call))
+      marks += (call.model->clusters().size() + kClusterGrain - 1) /
+               kClusterGrain;
+
+  auto mark_chunks = arena.allocate<Chunk>(marks);
+  std::size_t size = 0;
+  for (std::uint32_t draw = 0; draw < draws_.size(); draw++) {
+    if (!full_precision(draws_[draw])) continue;
+
+    auto clusters = draws_[draw].model->clusters().size();
+    for (std::size_t first = 0; first < clusters; first += kClusterGrain)
+      std::construct_at(mark_chunks + size++, draw, first,
+                        std::min(first + kClusterGrain, clusters));
+  }
 
-      auto &v0 = vtcs[0], &v1 = vtcs[1], &v2 = vtcs[2];
-
-      // x < -w
-      bool outside_left =
-          is_outside(v0.x(), -v0.w(), v1.x(), -v1.w(), v2.x(), -v2.w());
-      // x > w
-      bool outside_right =
-          is_outside(v0.w(), v0.x(), v1.w(), v1.x(), v2.w(), v2.x());
-      // y < -w
-      bool outside_bottom =
-          is_outside(v0.y(), -v0.w(), v1.y(), -v1.w(), v2.y(), -v2.w());
-      // y > w
-      bool outside_top =
-          is_outside(v0.w(), v0.y(), v1.w(), v1.y(), v2.w(), v2.y());
-      // z < -w
-      bool outside_near =
-          is_outside(v0.z(), -v0.w(), v1.z(), -v1.w(), v2.z(), -v2.w());
-      // z > w
-      bool outside_far =
-          is_outside(v0.w(), v0.z(), v1.w(), v1.z(), v2.w(), v2.z());
-
-      auto f1 = outside_left || outside_right;
-      auto f2 = outside_bottom || outside_top;
-      auto f3 = outside_near || outside_far;
-      auto f4 = f1 || f2 || f3;
-
-      if (f4)
-        // trivial reject
-        continue;
-      else {
-        v0 /= v0.w();
-        v1 /= v1.w();
-        v2 /= v2.w();
-
-        std::array<ta::vec2i, 3> vp_vtcs;
-        auto tmp = viewport_ * v0;
-        vp_vtcs[0] = ta::vec2i(static_cast<std::int32_t>(tmp.x()),
-                               static_cast<std::int32_t>(tmp.y()));
-        tmp = viewport_ * v1;
-        vp_vtcs[1] = ta::vec2i(static_cast<std::int32_t>(tmp.x()),
-                               static_cast<std::int32_t>(tmp.y()));
-        tmp = viewport_ * v2;
-        vp_vtcs[2] = ta::vec2i(static_cast<std::int32_t>(tmp.x()),
-                               static_cast<std::int32_t>(tmp.y()));
-
-        auto&& [width, height] = screen_size_;
-        ta::vec2i bboxmin(width - 1, height - 1);
-        ta::vec2i bboxmax(0, 0);
-        ta::vec2i clamp = bboxmin;
-
-        for (auto&& v : vp_vtcs) {
-          bboxmin.x() =
-              std::clamp(static_cast<int>(std::ceil(v.x())), 0, bboxmin.x());
-          bboxmin.y() =
-              std::clamp(static_cast<int>(std::ceil(v.y())), 0, bboxmin.y());
-
-          bboxmax.x() = std::clamp(static_cast<int>(std::ceil(v.x())),
-                                   bboxmax.x(), clamp.x());
-          bboxmax.y() = std::clamp(static_cast<int>(std::ceil(v.y())),
-                                   bboxmax.y(), clamp.y());
+  scheduler_.run(marks, [&](std::size_t idx, std::size_t) {
+    auto&& chunk = mark_chunks[idx];
+    auto&& call = draws_[chunk.draw];
+    decltype(auto) mesh = call.model->mesh();
+    auto&& clusters = call.model->clusters();
+    for (auto cluster_idx = chunk.first; cluster_idx < chunk.last;
+         cluster_idx++) {
+      if (!call.clusters[cluster_idx].visible) continue;
+
+      auto&& cluster = clusters[cluster_idx];
+      for (auto tri_idx = cluster.tris_begin; tri_idx != cluster.tris_end;
+           tri_idx++)
+        for (std::size_t corner = 0; corner < 3; corner++) {
+          auto vidx = mesh.tri_corner_ind(tri_idx, corner);
+          std::atomic_ref(used[chunk.draw][vidx])
+              .store(1, std::memory_order_relaxed);
         }
+    }
+  });
+
+  scheduler_.run(count, [&](std::size_t idx, std::size_t) {
+    auto&& chunk = chunks[idx];
+    auto&& call = draws_[chunk.draw];
+
+    if (auto compact = call.model->compact_mesh()) {
+      for (auto cluster_idx = chunk.first; cluster_idx < chunk.last;
+           cluster_idx++) {
+        if (!call.clusters[cluster_idx].visible) continue;
+
+        auto&& cluster = compact->cluster(cluster_idx);
+        for (auto vidx = cluster.vertices_begin; vidx < cluster.vertices_end;
+             vidx++)
+          std::construct_at(
+              call.clip + vidx,
+              call.shader->Vertex(compact->position(cluster, vidx)));
+      }
+      return;
+    }
 
-        ta::vec2i p;
+    decltype(auto) mesh = call.model->mesh();
+    for (auto vidx = chunk.first; vidx < chunk.last; vidx++) {
+      if (!used[chunk.draw][vidx]) continue;
+      auto a3f = mesh.vrt_coords(vidx);
+      ta::vec3 v(a3f[0], a3f[1], a3f[2]);
+      std::construct_at(call.clip + vidx, call.shader->Vertex(v));
+    }
+  });
+}
 
-        for (p.x() = bboxmin.x(); p.x() <= bboxmax.x(); p.x()++) {
-          for (p.y() = bboxmin.y(); p.y() <= bboxmax.y(); p.y()++) {
-            auto b = ta::barycentric(vp_vtcs[0], vp_vtcs[1], vp_vtcs[2], p);
-            if (!b || (b->x() < 0.f) || (b->y() < 0.f) || (b->z() < 0.f))
-              continue;
+void Engine::setup() {
+  auto&& arena = arenas_.front();
 
-            float z = 0.f;
-            for (auto&& [v, bc] : std::views::zip(vtcs, *b)) z += v.z() * bc;
+  // visible clusters of all draws in submission order
+  std::size_t count = 0;
+  for (auto&& call : draws_) {
+    if (!call.active) continue;
+    auto clusters = std::span(call.clusters, call.model->clusters().size());
+    count += static_cast<std::size_t>(std::ranges::count_if(
+        clusters, [](auto&& state) { return state.visible; }));
+  }
 
-            if (z < zgrid_[p.y()][p.x()]) {
-              zgrid_[p.y()][p.x()] = z;
+  auto refs = arena.allocate<ClusterRef>(count);
+  std::size_t size = 0, triangles = 0;
+  for (std::uint32_t draw = 0; draw < draws_.size(); draw++) {
+    auto&& call = draws_[draw];
+    if (!call.active) continue;
+
+    auto&& clusters = call.model->clusters();
+    for (std::uint32_t idx = 0; idx < clusters.size(); idx++) {
+      if (!call.clusters[idx].visible) continue;
+      std::construct_at(refs + size++, draw, idx);
+      triangles += clusters[idx].tris_end - clusters[idx].tris_begin;
+    }
+  }
 
-              ta::vec4 tipos(0.f);
-              for (auto&& [p, bc] : std::views::zip(vtcs, *b)) {
-                tipos += p * bc;
-              }
+  // Every job takes a contiguous run of clusters with about the same number
+  // of triangles and bins into its own tile bins. The rasterizer reads the
+  // bins job by job, so per tile the triangles keep submission order and
+  // the image does not depend on the number of workers.
+  auto jobs = geometry_jobs();
+  auto bounds = arena.allocate<std::size_t>(jobs + 1);
+  std::size_t first = 0, prefix = 0;
+  for (std::size_t job = 0; job <= jobs; job++) {
+    auto target = triangles * job / jobs;
+    while (first < count && prefix < target) {
+      auto&& ref = refs[first++];
+      auto&& cluster = draws_[ref.draw].model->clusters()[ref.cluster];
+      prefix += cluster.tris_end - cluster.tris_begin;
+    }
+    bounds[job] = job == jobs ? count : first;
+  }
 
-              ta::vec3 ipos(tipos);
-              auto light_dir = ta::normalize(ipos - light_pos);
-              auto dir = ta::normalize(ipos - camera_pos);
+  auto binned = arena.allocate<std::size_t>(jobs);
+  scheduler_.run(jobs, [&](std::size_t job, std::size_t worker) {
+    binned[job] = setup(std::span(refs + bounds[job], refs + bounds[job + 1]),
+                        job, arenas_[worker]);
+  });
 
-              auto cos = ta::dot(-light_dir, normal);
-              cos = std::clamp(cos, 0.f, 1.f);
+  stats_.triangles = std::accumulate(binned, binned + jobs, std::size_t(0));
+}
 
-              colors_[p.y()][p.x()][0] = cos;
-              colors_[p.y()][p.x()][1] = cos;
-              colors_[p.y()][p.x()][2] = cos;
-            }
-          }
+std::size_t Engine::setup(std::span<const ClusterRef> refs, std::size_t job,
+                          Arena& arena) {
+  std::size_t count = 0;
+
+  // corner lighting from the light cache of the draw if it has one, the
+  // cached modes need no world space positions
+  auto shading = [this](const DrawCall& call, std::size_t cluster,
+                        std::size_t tri_idx,
+                        const std::array<std::size_t, 3>& corners) {
+    TriangleShading result{};
+    if (auto cache = call.vertex_light)
+      result.light = {cache[corners[0]], cache[corners[1]], cache[corners[2]]};
+    else if (auto cache = call.triangle_light)
+      result.light = {cache[tri_idx], cache[tri_idx], cache[tri_idx]};
+    else
+      result = triangle_shading(call, cluster, tri_idx);
+    return result;
+  };
+
+  for (auto&& ref : refs) {
+    auto&& call = draws_[ref.draw];
+    auto&& cluster = call.model->clusters()[ref.cluster];
+    auto bins = bins_of(job, call.view);
+
+    // paged clusters carry unindexed triangles, there is nothing to share
+    if (auto page = call.clusters[ref.cluster].page) {
+      for (std::size_t tri_idx = cluster.tris_begin;
+           tri_idx != cluster.tris_end; tri_idx++) {
+        auto&& tri = page[tri_idx];
+        std::array<ta::vec4, 3> vtcs;
+        TriangleShading tri_shading;
+        for (auto&& [idx, vclip] : vtcs | std::views::enumerate) {
+          auto a3f = tri.vertices[idx];
+          ta::vec3 pos(a3f[0], a3f[1], a3f[2]);
+          vclip = call.shader->Vertex(pos);
+          tri_shading.world[idx] = to_world(call.model_matrix, pos);
         }
+
+        tri_shading.normal = to_world_normal(
+            call.normal_matrix,
+            ta::vec3(tri.normal[0], tri.normal[1], tri.normal[2]));
+        tri_shading.light = light(tri_shading.world, tri_shading.normal);
+        count += bin(vtcs, tri_shading, arena, bins);
       }
+      continue;
     }
+
+    auto clip = call.clip;
+    if (auto compact = call.model->compact_mesh()) {
+      auto&& packed = compact->cluster(ref.cluster);
+      for (auto tri_idx = cluster.tris_begin; tri_idx != cluster.tris_end;
+           tri_idx++) {
+        std::array<std::size_t, 3> corners;
+        std::array<ta::vec4, 3> vtcs;
+        for (std::size_t idx = 0; idx < 3; idx++) {
+          corners[idx] = compact->corner(packed, tri_idx, idx);
+          vtcs[idx] = clip[corners[idx]];
+        }
+
+        count += bin(vtcs, shading(call, ref.cluster, tri_idx, corners),
+                     arena, bins);
+      }
+      continue;
+    }
+
+    decltype(auto) mesh = call.model->mesh();
+
+    for (auto tri_idx = cluster.tris_begin; tri_idx != cluster.tris_end;
+         tri_idx++) {
+      std::array<std::size_t, 3> corners;
+      std::array<ta::vec4, 3> vtcs;
+      for (std::size_t idx = 0; idx < 3; idx++) {
+        corners[idx] = mesh.tri_corner_ind(tri_idx, idx);
+        vtcs[idx] = clip[corners[idx]];
+      }
+
+      count += bin(vtcs, shading(call, ref.cluster, tri_idx, corners), arena,
+                   bins);
+    }
+  }
+
+  return count;
+}
+
+bool Engine::bin(std::array<ta::vec4, 3> vtcs,
+                 const TriangleShading& shading, Arena& arena,
+                 TileBin* bins) {
+  auto &v0 = vtcs[0], &v1 = vtcs[1], &v2 = vtcs[2];
+
+  // x < -w
+  bool outside_left =
+      is_outside(v0.x(), -v0.w(), v1.x(), -v1.w(), v2.x(), -v2.w());
+  // x > w
+  bool outside_right =
+      is_outside(v0.w(), v0.x(), v1.w(), v1.x(), v2.w(), v2.x());
+  // y < -w
+  bool outside_bottom =
+      is_outside(v0.y(), -v0.w(), v1.y(), -v1.w(), v2.y(), -v2.w());
+  // y > w
+  bool outside_top =
+      is_outside(v0.w(), v0.y(), v1.w(), v1.y(), v2.w(), v2.y());
+  // z < -w
+  bool outside_near =
+      is_outside(v0.z(), -v0.w(), v1.z(), -v1.w(), v2.z(), -v2.w());
+  // z > w
+  bool outside_far =
+      is_outside(v0.w(), v0.z(), v1.w(), v1.z(), v2.w(), v2.z());
+
+  auto f1 = outside_left || outside_right;
+  auto f2 = outside_bottom || outside_top;
+  auto f3 = outside_near || outside_far;
+  auto f4 = f1 || f2 || f3;
+
+  if (f4)
+    // trivial reject
+    return false;
+  else {
+    std::array<float, 3> inv_w{1.f / v0.w(), 1.f / v1.w(), 1.f / v2.w()};
+    v0 /= v0.w();
+    v1 /= v1.w();
+    v2 /= v2.w();
+
+    std::array<ta::vec2i, 3> vp_vtcs;
+    auto tmp = viewport_ * v0;
+    vp_vtcs[0] = ta::vec2i(static_cast<std::int32_t>(tmp.x()),
+                           static_cast<std::int32_t>(tmp.y()));
+    tmp = viewport_ * v1;
+    vp_vtcs[1] = ta::vec2i(static_cast<std::int32_t>(tmp.x()),
+                           static_cast<std::int32_t>(tmp.y()));
+    tmp = viewport_ * v2;
+    vp_vtcs[2] = ta::vec2i(static_cast<std::int32_t>(tmp.x()),
+                           static_cast<std::int32_t>(tmp.y()));
+
+    auto&& [width, height] = screen_size_;
+    ta::vec2i bboxmin(width - 1, height - 1);
+    ta::vec2i bboxmax(0, 0);
+    ta::vec2i clamp = bboxmin;
+
+    for (auto&& v : vp_vtcs) {
+      bboxmin.x() =
+          std::clamp(static_cast<int>(std::ceil(v.x())), 0, bboxmin.x());
+      bboxmin.y() =
+          std::clamp(static_cast<int>(std::ceil(v.y())), 0, bboxmin.y());
+
+      bboxmax.x() = std::clamp(static_cast<int>(std::ceil(v.x())),
+                               bboxmax.x(), clamp.x());
+      bboxmax.y() = std::clamp(static_cast<int>(std::ceil(v.y())),
+                               bboxmax.y(), clamp.y());
+    }
+
+    ScreenRect tri_rect{bboxmin.x(), bboxmin.y(), bboxmax.x(), bboxmax.y()};
+
+    // Lighting is close to linear over a triangle, so its change per pixel
+    // is about the range at the corners over the screen extent. Coarser
+    // blocks are taken while they stay within half a color step.
+    std::uint8_t rate = 1;
+    if (shading_mode_ == ShadingMode::kPixel &&
+        max_shading_rate_ != ShadingRate::k1x1) {
+      auto&& [world, normal, light] = shading;
+      auto [lo, hi] = std::minmax({shade(world[0], normal),
+                                   shade(world[1], normal),
+                                   shade(world[2], normal)});
+      auto extent = std::max(tri_rect.xmax - tri_rect.xmin,
+                             tri_rect.ymax - tri_rect.ymin) +
+                    1;
+      auto gradient = (hi - lo) / static_cast<float>(extent);
+      auto max_rate = static_cast<std::uint8_t>(max_shading_rate_);
+      while (rate < max_rate && gradient * float(rate * 2 - 1) <= .5f / 255.f)
+        rate *= 2;
+    }
+
+    // ndc depth over the pixel grid, degenerate triangles cover no pixels
+    DepthPlane depth{v0.z(), 0.f, 0.f, vp_vtcs[0].x(), vp_vtcs[0].y()};
+    auto e1 = vp_vtcs[1] - vp_vtcs[0], e2 = vp_vtcs[2] - vp_vtcs[0];
+    auto det = static_cast<float>(std::int64_t(e1.x()) * e2.y() -
+                                  std::int64_t(e2.x()) * e1.y());
+    if (det != 0.f) {
+      auto dz1 = v1.z() - v0.z(), dz2 = v2.z() - v0.z();
+      depth.dzdx = (dz1 * float(e2.y()) - dz2 * float(e1.y())) / det;
+      depth.dzdy = (dz2 * float(e1.x()) - dz1 * float(e2.x())) / det;
+    }
+
+    auto tri = std::construct_at(arena.allocate<TriangleSetup>(),
+                                 shading.world, inv_w, vp_vtcs,
+                                 shading.normal, tri_rect, depth,
+                                 shading.light, rate);
+
+    auto tiles = tiles_of(tri_rect);
+    for (auto ty = tiles.ymin; ty <= tiles.ymax; ty++)
+      for (auto tx = tiles.xmin; tx <= tiles.xmax; tx++) {
+        auto tile_idx = ty * tiles_x_ + tx;
+        if (dirty_tiles_[tile_idx]) bins[tile_idx].push(arena, tri);
+      }
+  }
+
+  return true;
+}
+
+std::size_t Engine::geometry_jobs() const noexcept {
+  return scheduler_.concurrency();
+}
+
+TileBin* Engine::bins_of(std::size_t job, std::size_t view) noexcept {
+  return tile_bins_.data() + (job * views_ + view) * dirty_tiles_.size();
+}
+
+float Engine::shade(const ta::vec3& pos,
+                    const ta::vec3& normal) const noexcept {
+  auto light_dir = ta::normalize(pos - light_pos_);
+  return std::clamp(ta::dot(-light_dir, normal), 0.f, 1.f);
+}
+
+std::array<float, 3> Engine::light(const std::array<ta::vec3, 3>& world,
+                                   const ta::vec3& normal) const noexcept {
+  switch (shading_mode_) {
+    case ShadingMode::kFlat: {
+      auto value = shade((world[0] + world[1] + world[2]) / 3.f, normal);
+      return {value, value, value};
+    }
+    case ShadingMode::kGouraud:
+      return {shade(world[0], normal), shade(world[1], normal),
+              shade(world[2], normal)};
+    case ShadingMode::kPixel:
+      break;
   }
+  return {};
+}
+
+Engine::TriangleShading Engine::triangle_shading(
+    const DrawCall& call, std::size_t cluster,
+    std::size_t tri_idx) const noexcept {
+  auto&& model = *call.model;
+  TriangleShading result;
+  ta::vec3 normal(0.f);
+  if (auto compact = model.compact_mesh()) {
+    auto&& packed = compact->cluster(cluster);
+    for (std::size_t idx = 0; idx < 3; idx++)
+      result.world[idx] = compact->position(
+          packed, compact->corner(packed, tri_idx, idx));
+    normal = compact->normal(tri_idx);
+  } else {
+    decltype(auto) mesh = model.mesh();
+    for (std::size_t idx = 0; idx < 3; idx++) {
+      auto a3f = mesh.vrt_coords(mesh.tri_corner_ind(tri_idx, idx));
+      result.world[idx] = ta::vec3(a3f[0], a3f[1], a3f[2]);
+    }
+    auto a3f = mesh.tri_normal(tri_idx);
+    normal = ta::vec3(a3f[0], a3f[1], a3f[2]);
+  }
+
+  for (auto&& pos : result.world) pos = to_world(call.model_matrix, pos);
+  result.normal = to_world_normal(call.normal_matrix, normal);
+  result.light = light(result.world, result.normal);
+  return result;
+}
+
+Engine::TileStats Engine::rasterize(std::size_t view, std::size_t tile_idx,
+                                    const ScreenRect& tile, DepthTile& depth) {
+  auto&& target = targets_[view];
+  TileStats stats{0, 0, 0, false};
+  depth.reset(tile);
+
+  auto draw = [&](const TriangleSetup& tri) {
+    auto rect = intersect(tri.bounds, tile);
+    if (rect.empty()) return;
+
+    // behind everything drawn into the tile so far
+    if (tri.depth.min(rect) >= depth.zmax()) {
+      stats.depth_rejects++;
+      return;
+    }
+    // in front of everything, the pixels need no depth compare
+    depth.begin(tri.depth, tri.depth.max(rect) < depth.zmin());
+
+    // Blocks are aligned to multiples of the rate. The lighting of a block
+    // is evaluated at its center pixel once the first pixel of the block
+    // passes the depth test, so a block split between tiles gets the same
+    // value in both.
+    std::int32_t rate = tri.shading_rate;
+    bool interpolate = shading_mode_ != ShadingMode::kPixel;
+    auto center = [&](ta::vec2i p) {
+      ta::vec2i c(p.x() - p.x() % rate + rate / 2,
+                  p.y() - p.y() % rate + rate / 2);
+      auto b = ta::barycentric(tri.screen[0], tri.screen[1], tri.screen[2], c);
+      // screen barycentrics weighted by 1/w are perspective correct
+      std::array<float, 3> weights{b->x() * tri.inv_w[0],
+                                   b->y() * tri.inv_w[1],
+                                   b->z() * tri.inv_w[2]};
+      ta::vec3 pos(0.f);
+      for (auto&& [v, weight] : std::views::zip(tri.world, weights))
+        pos += v * weight;
+      return shade(pos / (weights[0] + weights[1] + weights[2]), tri.normal);
+    };
+
+    for (auto by = rect.ymin - rect.ymin % rate; by <= rect.ymax; by += rate)
+      for (auto bx = rect.xmin - rect.xmin % rate; bx <= rect.xmax;
+           bx += rate) {
+        float cos = -1.f;
+        ta::vec2i p;
+
+        for (p.y() = std::max(by, rect.ymin);
+             p.y() <= std::min(by + rate - 1, rect.ymax); p.y()++)
+          for (p.x() = std::max(bx, rect.xmin);
+               p.x() <= std::min(bx + rate - 1, rect.xmax); p.x()++) {
+            auto b = ta::barycentric(tri.screen[0], tri.screen[1],
+                                     tri.screen[2], p);
+            if (!b || (b->x() < 0.f) || (b->y() < 0.f) || (b->z() < 0.f))
+              continue;
+
+            if (!depth.test(p.x(), p.y())) continue;
+
+            if (interpolate) {
+              cos = b->x() * tri.light[0] + b->y() * tri.light[1] +
+                    b->z() * tri.light[2];
+            } else if (cos < 0.f) {
+              cos = center(p);
+              stats.shading_evaluations++;
+            }
+            stats.fragments++;
+
+            target.colors[p.y()][p.x()][0] = cos;
+            target.colors[p.y()][p.x()][1] = cos;
+            target.colors[p.y()][p.x()][2] = cos;
+          }
+      }
+  };
+
+  // bins of the geometry jobs in job order, which is submission order
+  for (std::size_t job = 0; job < geometry_jobs(); job++)
+    bins_of(job, view)[tile_idx].for_each(draw);
+
+  stats.compressed = depth.compressed();
+  return stats;
 }
 
 void Engine::display() const noexcept {
+  if (!VAO) return;
+
   glClear(GL_COLOR_BUFFER_BIT);
   glClearColor(0.2f, 0.3f, 0.3f, 1.f);
 
@@ -320,6 +1289,30 @@ void Engine::display() const noexcept {
   glBindVertexArray(0);
 }
 
+void Engine::occlusion_culling(bool enabled) noexcept {
+  if (enabled != occlusion_culling_) frame_valid_ = false;
+  occlusion_culling_ = enabled;
+}
+
+void Engine::shading_rate(ShadingRate max_rate) noexcept {
+  if (max_rate != max_shading_rate_) frame_valid_ = false;
+  max_shading_rate_ = max_rate;
+}
+
+void Engine::shading_mode(ShadingMode mode) noexcept {
+  if (mode == shading_mode_) return;
+  // cached values are vertex or triangle lighting depending on the mode
+  light_caches_.clear();
+  frame_valid_ = false;
+  shading_mode_ = mode;
+}
+
+void Engine::light_position(const ta::vec3& pos) noexcept {
+  // light caches are keyed on the position and rebuilt on the next frame
+  frame_valid_ = false;
+  light_pos_ = pos;
+}
+
 void Engine::viewport(std::int32_t xmin, std::int32_t ymin, std::int32_t width,
                       std::int32_t height) noexcept {
   viewport_ = ta::viewport(xmin, ymin, width, height);
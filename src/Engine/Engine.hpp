@@ -1,16 +1,22 @@
 #pragma once
 
+#include <array>
+#include <cstdint>
 #include <memory>
+#include <span>
 #include <tuple>
 #include <vector>
 
 #include <glewext/glewext.hpp>
 #include <glfwext/Window.hpp>
-#include <threadpool/threadpool.hpp>
 #include <tinyalgebra/math/type_decl.hpp>
 
+#include "Arena.hpp"
+#include "DepthTile.hpp"
 #include "Model/Model.hpp"
+#include "Occlusion.hpp"
 #include "Pipeline.hpp"
+#include "Scheduler.hpp"
 #include "Shader.hpp"
 #include "Utility.hpp"
 
@@ -18,39 +24,285 @@ namespace engine {
 
 class Engine final {
  public:
-  Engine(std::size_t tile_size);
-  Engine(std::size_t width, std::size_t height, std::size_t tile_size);
+  // Side in pixels of the blocks shaded with one lighting evaluation.
+  enum class ShadingRate : std::uint8_t { k1x1 = 1, k2x2 = 2, k4x4 = 4 };
+
+  // Where lighting is evaluated. Lighting is done in world space, the
+  // model matrix maps models there. Flat and Gouraud light triangles or
+  // vertices ahead of the rasterizer, which interpolates the results.
+  enum class ShadingMode : std::uint8_t {
+    // once per triangle at its center
+    kFlat,
+    // per vertex with area weighted vertex normals; streamed models have
+    // none and use the triangle normal at every corner
+    kGouraud,
+    // per pixel, or per block of the shading rate
+    kPixel,
+  };
+
+  // Counters of the last render() that redrew anything.
+  struct FrameStats {
+    // arena blocks taken from the heap, zero once the arenas are warm;
+    // other engine containers are not counted
+    std::size_t arena_blocks_allocated{0};
+    // bytes owned by all frame arenas
+    std::size_t arena_capacity{0};
+    // triangles that passed culling and were binned
+    std::size_t triangles{0};
+    // clusters of the redrawn models and how many of them were culled
+    std::size_t clusters{0};
+    std::size_t clusters_culled{0};
+    // pixels written and per pixel lighting evaluations spent on them
+    std::size_t fragments{0};
+    std::size_t shading_evaluations{0};
+    // rasterized tiles, how many of them kept a plane encoded depth and
+    // triangle-tile pairs rejected by the depth range of the tile
+    std::size_t tiles{0};
+    std::size_t tiles_compressed{0};
+    std::size_t depth_rejects{0};
+  };
+
+  // Camera of one view of a batch.
+  struct View {
+    IShader* shader;
+    ta::vec3 camera_pos;
+  };
+
+  // Without init() the engine is headless: resize() sets the size of
+  // images rendered by render_views() and display() does nothing.
+  Engine(Scheduler& scheduler, std::size_t tile_size);
+  Engine(Scheduler& scheduler, std::size_t width, std::size_t height,
+         std::size_t tile_size);
   ~Engine();
 
   void init(std::size_t width, std::size_t height);
   void resize(std::size_t width, std::size_t height);
+  // Clears the framebuffer and forgets the previous frame, so the next
+  // render() redraws everything.
   void reset();
 
+  // Starts a new draw list. Models drawn in the previous frame and not
+  // submitted again are erased on the next render().
+  void begin_frame() noexcept;
+
+  // Submits a model for the current frame. The shader is evaluated in
+  // render() and has to stay alive and unchanged until then.
   void operator()(Model& model, IShader* shader, const ta::vec3& camera_pos);
 
+  // Draws the submitted models. Draws equal to the previous frame are not
+  // repeated: when nothing changed the framebuffer is kept as is, otherwise
+  // only tiles covered by old and new bounds of changed draws are redrawn.
+  // Returns false if the framebuffer was left untouched.
+  bool render();
+
+  // Renders a model once per view into the matching image, which is
+  // resized to the engine size. All views go through the pipeline together:
+  // culling, vertex and setup passes are shared scheduler passes, and the
+  // rasterizer schedules (view, tile) pairs. The window framebuffer is not
+  // touched, models submitted since begin_frame() are dropped.
+  void render_views(Model& model, std::span<const View> views,
+                    std::span<Image> images);
+
+  const FrameStats& stats() const noexcept;
+
+  // Enables the occlusion pre-pass: the largest clusters on screen are
+  // drawn into a coarse depth buffer and clusters hidden behind them skip
+  // vertex processing. On by default.
+  void occlusion_culling(bool enabled) noexcept;
+
+  // Coarsest shading rate triangles may use. A triangle is shaded once per
+  // block when its lighting changes by less than a color step across a
+  // block; depth and coverage stay per pixel, so silhouettes are kept.
+  // k1x1, the default, shades every pixel. Applies to kPixel shading only.
+  void shading_rate(ShadingRate max_rate) noexcept;
+
+  // kPixel by default. Flat and Gouraud lighting of a model is computed
+  // for the whole model and cached while its mesh, its model matrix and
+  // the light stay the same, so camera moves and further views of the
+  // model reuse it.
+  void shading_mode(ShadingMode mode) noexcept;
+
+  // World space position of the point light, above the origin by default.
+  void light_position(const ta::vec3& pos) noexcept;
+
   void display() const noexcept;
 
   void viewport(std::int32_t xmin, std::int32_t ymin, std::int32_t width,
                 std::int32_t height) noexcept;
 
  private:
+  // vertices transformed per scheduler job
+  static constexpr std::size_t kVertexGrain = 4096;
+  // cluster bounds projected per scheduler job
+  static constexpr std::size_t kClusterGrain = 64;
+  // occluders drawn into the coarse depth buffer per frame
+  static constexpr std::size_t kMaxOccluders = 32;
+  // minimum screen area in pixels of an occluder cluster
+  static constexpr std::int64_t kOccluderMinArea = 32 * 32;
+
+  struct ProjectedBox {
+    ScreenRect rect;
+    // nearest ndc depth, lowest() if the box crosses the camera plane
+    float zmin;
+  };
+
+  struct ClusterState {
+    ProjectedBox box;
+    bool visible;
+    // triangles of a resident page of a streamed model
+    const PagedTriangle* page{nullptr};
+  };
+
+  struct DrawCall {
+    Model* model;
+    IShader* shader;
+    ta::vec3 camera_pos;
+    std::uint64_t hash;
+    ScreenRect bounds;
+    // model matrix, object to world space, and the columns of its
+    // cofactor matrix, which take normals to world space also under
+    // non-uniform scaling
+    ta::mat4 model_matrix;
+    std::array<ta::vec3, 3> normal_matrix;
+    // valid inside render() only
+    bool active{false};
+    ClusterState* clusters{nullptr};
+    ta::vec4* clip{nullptr};
+    // cached lighting of vertices for Gouraud and of triangles for flat
+    // shading, nullptr if not cached
+    const float* vertex_light{nullptr};
+    const float* triangle_light{nullptr};
+    // target of a batch, 0 for render()
+    std::uint32_t view{0};
+  };
+
+  // Framebuffer a view is drawn into.
+  struct Target {
+    mdspan<float, 3> colors;
+  };
+
+  struct TileStats {
+    std::uint32_t fragments;
+    std::uint32_t shading_evaluations;
+    std::uint32_t depth_rejects;
+    bool compressed;
+  };
+
+  // Lighting of all vertices or triangles of a model, shared by its draws
+  // and kept across frames. It is filled when the key changes and only read
+  // while a frame is drawn.
+  struct LightCache {
+    Model* model;
+    std::uint64_t key;
+    std::vector<float> light;
+    bool used;
+  };
+
+  // Lighting inputs of a triangle: world space corners and normal for per
+  // pixel shading, corner lighting for flat and Gouraud shading.
+  struct TriangleShading {
+    std::array<ta::vec3, 3> world;
+    ta::vec3 normal;
+    std::array<float, 3> light;
+  };
+
+  struct ClusterRef {
+    std::uint32_t draw;
+    std::uint32_t cluster;
+  };
+
+  void allocate_buffers(std::size_t width, std::size_t height);
+  // Runs the pipeline for draws_ into targets_ over the dirty tiles.
+  void draw();
+  ProjectedBox project(const std::array<ta::vec3, 2>& box,
+                       IShader* shader) const;
+  void update_tiles();
+  // Tile coordinates of the tiles covering a pixel rectangle.
+  ScreenRect tiles_of(const ScreenRect& rect) const noexcept;
+  ScreenRect tile_rect(std::int32_t tx, std::int32_t ty) const noexcept;
+  bool collect_dirty_tiles();
+  void clear(Target& target, const ScreenRect& rect);
+  // Hands out light caches to the active draws and fills caches whose model
+  // or light changed. Caches of models gone since the last frame are
+  // dropped.
+  void bind_light_caches();
+  // Frustum and occlusion culling of the clusters of active draws.
+  void cull();
+  void rasterize_occluders(std::size_t view);
+  // Triangles of a cluster of a streamed model, nullptr while they are not
+  // in memory; requests a page with the given priority if needed.
+  static const PagedTriangle* triangles(const DrawCall& call,
+                                        std::size_t cluster, float priority);
+  // Transforms the vertices used by visible clusters of indexed draws.
+  void transform();
+  // Triangle setup of all visible clusters, split into geometry jobs; the
+  // triangles are binned to the dirty tiles they overlap.
+  void setup();
+  // Sets up the triangles of the given clusters into the bins of a job.
+  // Returns the number of binned triangles.
+  std::size_t setup(std::span<const ClusterRef> refs, std::size_t job,
+                    Arena& arena);
+  // Culls, sets up and bins one triangle. Returns false if it was rejected.
+  bool bin(std::array<ta::vec4, 3> vtcs, const TriangleShading& shading,
+           Arena& arena, TileBin* bins);
+  std::size_t geometry_jobs() const noexcept;
+  // Tile bins a geometry job fills for a view.
+  TileBin* bins_of(std::size_t job, std::size_t view) noexcept;
+  // Diffuse lighting of a point in world space.
+  float shade(const ta::vec3& pos, const ta::vec3& normal) const noexcept;
+  // Corner lighting of a world space triangle for the shading mode.
+  std::array<float, 3> light(const std::array<ta::vec3, 3>& world,
+                             const ta::vec3& normal) const noexcept;
+  // World space corners, normal and lighting of a triangle of an indexed
+  // or quantized model.
+  TriangleShading triangle_shading(const DrawCall& call, std::size_t cluster,
+                                   std::size_t tri_idx) const noexcept;
+  TileStats rasterize(std::size_t view, std::size_t tile_idx,
+                      const ScreenRect& tile, DepthTile& depth);
+
   std::size_t tile_size_;
   std::tuple<int, int> screen_size_;
-  TileQueueGrid tile_queue_array_;
-  mdspan<TileQueue*, 2> tile_queue_grid_;
+  std::int32_t tiles_x_{0}, tiles_y_{0};
+  // bins of every geometry job and view, job-major
+  std::vector<TileBin> tile_bins_;
+  // targets of the frame being drawn, one per view
+  std::vector<Target> targets_;
+  std::size_t views_{1};
 
-  std::vector<float> zbuffer_;
-  mdspan<float, 2> zgrid_;
   std::vector<float> screen_points_buffer_;
   // mdspan<float, 3> sp_grid_;
   std::vector<float> color_buffer_;
   mdspan<float, 3> colors_;
 
+  std::vector<DrawCall> draws_;
+  std::vector<DrawCall> last_draws_;
+  // false until the framebuffer holds a complete frame of last_draws_.
+  bool frame_valid_{false};
+  std::vector<std::uint8_t> dirty_tiles_;
+  std::vector<std::uint32_t> tile_order_;
+  std::vector<std::uint32_t> tile_cost_;
+
+  bool occlusion_culling_{true};
+  ShadingRate max_shading_rate_{ShadingRate::k1x1};
+  ShadingMode shading_mode_{ShadingMode::kPixel};
+  std::vector<LightCache> light_caches_;
+  // world space
+  ta::vec3 light_pos_{0.f, 100.f, 0.f};
+  // one per view
+  std::vector<OcclusionBuffer> occlusion_;
+
+  // Transient data of the frame being rendered, one arena per scheduler
+  // worker.
+  std::vector<Arena> arenas_;
+  // depth of the tile a worker rasterizes
+  std::vector<DepthTile> depth_tiles_;
+  FrameStats stats_;
+
   ta::mat4 viewport_;
-  GLuint VAO, VBOPos, VBOCol;
+  GLuint VAO{0}, VBOPos{0}, VBOCol{0};
   std::unique_ptr<glewext::Shader> shader_;
 
-  threadpool::threadpool pool_;
+  Scheduler& scheduler_;
 };
 
 }  // namespace engine
\ No newline at end of file
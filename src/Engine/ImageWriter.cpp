@@ -0,0 +1,293 @@
+#include "ImageWriter.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <ostream>
+#include <stdexcept>
+#include <utility>
+
+namespace engine {
+
+namespace {
+
+constexpr auto kCrcTable = [] {
+  std::array<std::uint32_t, 256> table{};
+  for (std::uint32_t n = 0; n < table.size(); n++) {
+    auto c = n;
+    for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+    table[n] = c;
+  }
+  return table;
+}();
+
+std::uint32_t adler32(const std::uint8_t* data, std::size_t size) {
+  // 5552 bytes are the most that can be summed before b overflows
+  std::uint32_t a = 1, b = 0;
+  while (size) {
+    auto n = std::min<std::size_t>(size, 5552);
+    for (auto end = data + n; data != end; data++) {
+      a += *data;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+    size -= n;
+  }
+  return b << 16 | a;
+}
+
+// PNG chunk written straight to the stream while its CRC is accumulated.
+class PngChunk {
+ public:
+  PngChunk(std::ostream& stream, const char* type, std::uint32_t size)
+      : stream_(stream) {
+    put_be(size);
+    crc_ = 0xffffffffu;
+    put(type, 4);
+  }
+  ~PngChunk() { put_be(crc_ ^ 0xffffffffu); }
+
+  void put(const void* data, std::size_t size) {
+    auto bytes = static_cast<const std::uint8_t*>(data);
+    for (std::size_t i = 0; i < size; i++)
+      crc_ = kCrcTable[(crc_ ^ bytes[i]) & 0xff] ^ (crc_ >> 8);
+    stream_.write(static_cast<const char*>(data),
+                  static_cast<std::streamsize>(size));
+  }
+  void put_be(std::uint32_t value) {
+    std::uint8_t bytes[] = {
+        std::uint8_t(value >> 24), std::uint8_t(value >> 16),
+        std::uint8_t(value >> 8), std::uint8_t(value)};
+    put(bytes, sizeof(bytes));
+  }
+
+ private:
+  std::ostream& stream_;
+  std::uint32_t crc_{0};
+};
+
+// 8 bit rgb with every row filtered as none, the zlib stream uses stored
+// blocks only, so the cost is a pass for the checksums
+void write_png(std::ostream& stream, std::size_t width, std::size_t height,
+               const std::vector<std::uint8_t>& pixels) {
+  constexpr std::size_t kBlock = 65535;
+  static constexpr std::uint8_t kSignature[] = {0x89, 'P',  'N',  'G',
+                                                '\r', '\n', 0x1a, '\n'};
+  stream.write(reinterpret_cast<const char*>(kSignature), sizeof(kSignature));
+
+  {
+    PngChunk header(stream, "IHDR", 13);
+    header.put_be(static_cast<std::uint32_t>(width));
+    header.put_be(static_cast<std::uint32_t>(height));
+    // 8 bit rgb, deflate, adaptive filtering, no interlace
+    std::uint8_t format[] = {8, 2, 0, 0, 0};
+    header.put(format, sizeof(format));
+  }
+
+  auto blocks =
+      std::max<std::size_t>((pixels.size() + kBlock - 1) / kBlock, 1);
+  {
+    auto size = 2 + blocks * 5 + pixels.size() + 4;
+    PngChunk data(stream, "IDAT", static_cast<std::uint32_t>(size));
+    std::uint8_t zlib[] = {0x78, 0x01};
+    data.put(zlib, sizeof(zlib));
+
+    for (std::size_t block = 0; block < blocks; block++) {
+      auto first = block * kBlock;
+      auto size = std::min(kBlock, pixels.size() - first);
+      std::uint8_t stored[] = {
+          std::uint8_t(block + 1 == blocks),
+          std::uint8_t(size),
+          std::uint8_t(size >> 8),
+          std::uint8_t(~size),
+          std::uint8_t(~size >> 8)};
+      data.put(stored, sizeof(stored));
+      data.put(pixels.data() + first, size);
+    }
+    data.put_be(adler32(pixels.data(), pixels.size()));
+  }
+
+  PngChunk end(stream, "IEND", 0);
+}
+
+}  // namespace
+
+ImageWriter::ImageWriter(std::size_t buffers, std::size_t threads) {
+  threads = std::max<std::size_t>(threads, 1);
+
+  jobs_.resize(std::max<std::size_t>(buffers, 1));
+  for (auto&& job : jobs_) {
+    job = std::make_unique<Job>();
+    free_.push_back(job.get());
+  }
+
+  encoders_.reserve(threads);
+  for (std::size_t i = 0; i < threads; i++)
+    encoders_.emplace_back([this] { encoder_loop(); });
+}
+
+ImageWriter::~ImageWriter() {
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (auto&& encoder : encoders_) encoder.join();
+}
+
+Image ImageWriter::acquire() {
+  std::unique_lock lock(mutex_);
+  auto job = wait_free(lock);
+  lent_.push_back(job);
+  return std::move(job->image);
+}
+
+void ImageWriter::submit(Image&& image, std::filesystem::path file) {
+  if (image.color.size() != image.width * image.height * 3)
+    throw std::invalid_argument("Image size doesn't match its pixels");
+
+  Job* job;
+  {
+    std::unique_lock lock(mutex_);
+    if (!lent_.empty()) {
+      job = lent_.back();
+      lent_.pop_back();
+    } else {
+      job = wait_free(lock);
+    }
+  }
+
+  // the job is owned by this thread until it is queued
+  job->format = file.extension() == ".png" ? Format::kPng : Format::kPpm;
+  job->image = std::move(image);
+  job->file = std::move(file);
+
+  auto&& img = job->image;
+  auto stride = img.width * 3 + (job->format == Format::kPng);
+  job->pixels.resize(stride * img.height);
+  job->strips =
+      std::max<std::size_t>((img.height + kStripRows - 1) / kStripRows, 1);
+  job->next_strip = 0;
+  job->remaining.store(job->strips, std::memory_order_relaxed);
+
+  {
+    std::lock_guard lock(mutex_);
+    queue_.push_back(job);
+    in_flight_++;
+  }
+  cv_.notify_all();
+}
+
+void ImageWriter::finish() {
+  std::unique_lock lock(mutex_);
+  done_.wait(lock, [this] { return !in_flight_; });
+  rethrow();
+}
+
+ImageWriter::Stats ImageWriter::stats() const {
+  std::lock_guard lock(mutex_);
+  return stats_;
+}
+
+void ImageWriter::encoder_loop() {
+  for (;;) {
+    Job* job;
+    std::size_t strip;
+    {
+      std::unique_lock lock(mutex_);
+      cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      // queued images are still written when stopping
+      if (queue_.empty()) return;
+
+      job = queue_.front();
+      strip = job->next_strip++;
+      if (job->next_strip == job->strips) queue_.pop_front();
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    encode_strip(*job, strip);
+
+    std::size_t bytes = 0;
+    std::exception_ptr error;
+    bool last = job->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    if (last) {
+      try {
+        bytes = write(*job);
+      } catch (...) {
+        error = std::current_exception();
+      }
+    }
+    std::chrono::duration<double> seconds =
+        std::chrono::steady_clock::now() - begin;
+
+    {
+      std::lock_guard lock(mutex_);
+      stats_.encode_seconds += seconds.count();
+      if (last) {
+        if (error && !error_) error_ = error;
+        stats_.images += !error;
+        stats_.bytes += bytes;
+        release(job);
+      }
+    }
+    if (last) done_.notify_all();
+  }
+}
+
+void ImageWriter::encode_strip(Job& job, std::size_t strip) {
+  auto&& image = job.image;
+  auto row_bytes = image.width * 3;
+  auto png = job.format == Format::kPng;
+  auto stride = row_bytes + png;
+
+  auto last = std::min((strip + 1) * kStripRows, image.height);
+  for (auto row = strip * kStripRows; row < last; row++) {
+    auto dst = job.pixels.data() + row * stride;
+    if (png) *dst++ = 0;
+
+    // rows are stored bottom-up
+    auto src = image.color.data() + (image.height - 1 - row) * row_bytes;
+    std::transform(src, src + row_bytes, dst, [](float c) {
+      return static_cast<std::uint8_t>(std::clamp(c, 0.f, 1.f) * 255.f + .5f);
+    });
+  }
+}
+
+std::size_t ImageWriter::write(const Job& job) {
+  std::ofstream stream(job.file, std::ios::binary);
+  if (!stream) throw std::runtime_error("Can't create " + job.file.string());
+
+  auto&& image = job.image;
+  if (job.format == Format::kPng) {
+    write_png(stream, image.width, image.height, job.pixels);
+  } else {
+    stream << "P6\n" << image.width << ' ' << image.height << "\n255\n";
+    stream.write(reinterpret_cast<const char*>(job.pixels.data()),
+                 static_cast<std::streamsize>(job.pixels.size()));
+  }
+
+  if (!stream) throw std::runtime_error("Can't write " + job.file.string());
+  return static_cast<std::size_t>(stream.tellp());
+}
+
+void ImageWriter::release(Job* job) {
+  free_.push_back(job);
+  in_flight_--;
+}
+
+ImageWriter::Job* ImageWriter::wait_free(std::unique_lock<std::mutex>& lock) {
+  if (free_.empty()) stats_.stalls++;
+  done_.wait(lock, [this] { return !free_.empty(); });
+
+  auto job = free_.back();
+  free_.pop_back();
+  return job;
+}
+
+void ImageWriter::rethrow() {
+  if (error_) std::rethrow_exception(std::exchange(error_, nullptr));
+}
+
+}  // namespace engine
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Utility.hpp"
+
+namespace engine {
+
+// Encodes rendered images and writes them to disk on background threads.
+//
+// The writer owns a fixed number of image buffers. acquire() lends out a
+// recycled buffer to render into and submit() moves it back together with
+// its file name, so no pixels are copied on the way. Encoder threads convert
+// submitted images in row strips, several threads per image, and the thread
+// finishing the last strip writes the file and recycles the buffer. When all
+// buffers are in flight acquire() blocks, which throttles rendering to the
+// encoder throughput and keeps memory fixed.
+//
+// Files ending in .png are written as PNG with stored deflate blocks, all
+// others as binary PPM.
+class ImageWriter final {
+ public:
+  // image rows per encoder job
+  static constexpr std::size_t kStripRows = 32;
+
+  struct Stats {
+    std::size_t images{0};
+    std::size_t bytes{0};
+    // time encoder threads spent converting and writing images
+    double encode_seconds{0.};
+    // acquire() and submit() calls that had to wait for a free buffer
+    std::size_t stalls{0};
+  };
+
+  // The encoder threads run next to the scheduler workers, so the default
+  // pool is kept small.
+  explicit ImageWriter(std::size_t buffers, std::size_t threads = 2);
+  // Writes the images still queued, errors are dropped.
+  ~ImageWriter();
+
+  ImageWriter(const ImageWriter&) = delete;
+  ImageWriter& operator=(const ImageWriter&) = delete;
+
+  // Returns a recycled buffer, waits while all buffers are in flight.
+  Image acquire();
+  // Queues an image for writing. Images not obtained from acquire() take the
+  // place of a free buffer.
+  void submit(Image&& image, std::filesystem::path file);
+  // Waits until every submitted image is written and rethrows the first
+  // encoder error.
+  void finish();
+
+  Stats stats() const;
+
+ private:
+  enum class Format : std::uint8_t { kPpm, kPng };
+
+  struct Job {
+    Image image;
+    std::filesystem::path file;
+    Format format{Format::kPpm};
+    // 8 bit rows top-down, PNG rows start with their filter byte
+    std::vector<std::uint8_t> pixels;
+    std::size_t strips{0};
+    std::size_t next_strip{0};
+    std::atomic<std::size_t> remaining{0};
+  };
+
+  void encoder_loop();
+  static void encode_strip(Job& job, std::size_t strip);
+  static std::size_t write(const Job& job);
+  void release(Job* job);
+  Job* wait_free(std::unique_lock<std::mutex>& lock);
+  void rethrow();
+
+  std::vector<std::unique_ptr<Job>> jobs_;
+  // jobs holding a recycled buffer, jobs whose buffer is lent out and
+  // submitted jobs with strips not yet handed to an encoder
+  std::vector<Job*> free_;
+  std::vector<Job*> lent_;
+  std::deque<Job*> queue_;
+  std::size_t in_flight_{0};
+
+  Stats stats_;
+  std::exception_ptr error_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::condition_variable done_;
+  bool stop_{false};
+  std::vector<std::thread> encoders_;
+};
+
+}  // namespace engine
@@ -0,0 +1,158 @@
+#include "CompactMesh.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+namespace engine {
+
+namespace {
+
+constexpr float kPositionMax = 65535.f;
+constexpr float kNormalMax = 32767.f;
+
+std::int16_t snorm16(float v) {
+  return static_cast<std::int16_t>(
+      std::lround(std::clamp(v, -1.f, 1.f) * kNormalMax));
+}
+
+float sign(float v) { return v < 0.f ? -1.f : 1.f; }
+
+// Maps the unit sphere onto the square [-1, 1]^2, folding the lower
+// hemisphere over the diagonals.
+std::array<std::int16_t, 2> encode_normal(const float* n) {
+  auto sum = std::abs(n[0]) + std::abs(n[1]) + std::abs(n[2]);
+  if (sum == 0.f) return {0, 0};
+
+  auto x = n[0] / sum, y = n[1] / sum;
+  if (n[2] < 0.f) {
+    auto fx = (1.f - std::abs(y)) * sign(x);
+    auto fy = (1.f - std::abs(x)) * sign(y);
+    x = fx;
+    y = fy;
+  }
+  return {snorm16(x), snorm16(y)};
+}
+
+ta::vec3 decode_normal(const std::array<std::int16_t, 2>& packed) {
+  auto x = packed[0] / kNormalMax;
+  auto y = packed[1] / kNormalMax;
+  auto z = 1.f - std::abs(x) - std::abs(y);
+  if (z < 0.f) {
+    auto fx = (1.f - std::abs(y)) * sign(x);
+    auto fy = (1.f - std::abs(x)) * sign(y);
+    x = fx;
+    y = fy;
+  }
+  return ta::normalize(ta::vec3(x, y, z));
+}
+
+}  // namespace
+
+CompactMesh::CompactMesh(const stl_reader::StlMesh<float, std::size_t>& mesh,
+                         std::span<const std::array<std::size_t, 2>> ranges,
+                         std::span<const ta::vec3> vertex_normals)
+    : corners_(mesh.num_tris()), normals_(mesh.num_tris()) {
+  constexpr auto kUnused = std::numeric_limits<std::uint32_t>::max();
+  std::vector<std::uint32_t> local(mesh.num_vrts(), kUnused);
+  std::vector<std::size_t> vertices;
+
+  // Lattice of the mesh: the origin is the mesh minimum and the step fits
+  // the largest cluster extent into 16 bits, with one step to spare for
+  // rounding vertices onto the lattice.
+  std::array<float, 3> lo, extent{0.f, 0.f, 0.f};
+  lo.fill(std::numeric_limits<float>::max());
+  for (auto&& [first, last] : ranges) {
+    std::array<float, 3> cluster_lo, cluster_hi;
+    cluster_lo.fill(std::numeric_limits<float>::max());
+    cluster_hi.fill(std::numeric_limits<float>::lowest());
+    for (auto tri = first; tri < last; tri++)
+      for (std::size_t c = 0; c < 3; c++)
+        for (std::size_t k = 0; k < 3; k++) {
+          auto v = mesh.tri_corner_coords(tri, c)[k];
+          cluster_lo[k] = std::min(cluster_lo[k], v);
+          cluster_hi[k] = std::max(cluster_hi[k], v);
+        }
+    if (first == last) continue;
+    for (std::size_t k = 0; k < 3; k++) {
+      lo[k] = std::min(lo[k], cluster_lo[k]);
+      extent[k] = std::max(extent[k], cluster_hi[k] - cluster_lo[k]);
+    }
+  }
+  std::array<float, 3> step;
+  for (std::size_t k = 0; k < 3; k++) {
+    if (lo[k] == std::numeric_limits<float>::max()) lo[k] = 0.f;
+    step[k] = extent[k] / (kPositionMax - 1.f);
+  }
+  origin_ = ta::vec3(lo[0], lo[1], lo[2]);
+  step_ = ta::vec3(step[0], step[1], step[2]);
+
+  // lattice coordinate of a vertex, the same for every cluster using it
+  auto lattice = [&](std::size_t vertex, std::size_t k) -> std::int64_t {
+    if (step[k] <= 0.f) return 0;
+    return std::llround((mesh.vrt_coords(vertex)[k] - lo[k]) / step[k]);
+  };
+
+  clusters_.reserve(ranges.size());
+  for (auto&& [first, last] : ranges) {
+    // local vertices in order of first use
+    vertices.clear();
+    for (auto tri = first; tri < last; tri++)
+      for (std::size_t c = 0; c < 3; c++) {
+        auto vertex = mesh.tri_corner_ind(tri, c);
+        if (local[vertex] == kUnused) {
+          if (vertices.size() > std::numeric_limits<std::uint16_t>::max())
+            throw std::runtime_error("Too many vertices in a mesh cluster");
+          local[vertex] = static_cast<std::uint32_t>(vertices.size());
+          vertices.push_back(vertex);
+        }
+        corners_[tri][c] = static_cast<std::uint16_t>(local[vertex]);
+      }
+
+    Cluster cluster{static_cast<std::uint32_t>(positions_.size()),
+                    static_cast<std::uint32_t>(positions_.size() +
+                                               vertices.size()),
+                    {0, 0, 0}};
+    for (std::size_t k = 0; k < 3 && !vertices.empty(); k++) {
+      auto origin = std::numeric_limits<std::int64_t>::max();
+      for (auto vertex : vertices) origin = std::min(origin, lattice(vertex, k));
+      cluster.offset[k] = static_cast<std::uint32_t>(origin);
+    }
+    clusters_.push_back(cluster);
+
+    for (auto vertex : vertices) {
+      std::array<std::uint16_t, 3> q;
+      for (std::size_t k = 0; k < 3; k++)
+        q[k] = static_cast<std::uint16_t>(
+            std::clamp<std::int64_t>(lattice(vertex, k) - cluster.offset[k], 0,
+                                     std::int64_t(kPositionMax)));
+      positions_.push_back(q);
+      auto&& n = vertex_normals[vertex];
+      float normal[] = {n.x(), n.y(), n.z()};
+      vertex_normals_.push_back(encode_normal(normal));
+      local[vertex] = kUnused;
+    }
+
+    for (auto tri = first; tri < last; tri++)
+      normals_[tri] = encode_normal(mesh.tri_normal(tri));
+  }
+}
+
+ta::vec3 CompactMesh::normal(std::size_t tri) const noexcept {
+  return decode_normal(normals_[tri]);
+}
+
+ta::vec3 CompactMesh::vertex_normal(std::size_t vertex) const noexcept {
+  return decode_normal(vertex_normals_[vertex]);
+}
+
+std::size_t CompactMesh::bytes() const noexcept {
+  return clusters_.size() * sizeof(Cluster) +
+         positions_.size() * sizeof(positions_[0]) +
+         corners_.size() * sizeof(corners_[0]) +
+         normals_.size() * sizeof(normals_[0]) +
+         vertex_normals_.size() * sizeof(vertex_normals_[0]);
+}
+
+}  // namespace engine
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include <stl_reader.h>
+
+#include <tinyalgebra/math/math.hpp>
+
+namespace engine {
+
+// Quantized copy of an indexed mesh split into clusters of consecutive
+// triangles. Positions are snapped to one lattice for the whole mesh, with a
+// step of 1/65534 of the largest cluster extent, and are off by up to half a
+// step. Model clusters are runs in file order that may span much of the
+// model, so the step is often close to the model extent / 65534.
+//
+// Every cluster owns its vertices, stored as 16 bit lattice offsets from the
+// cluster origin, and its triangles index them with 16 bit local indices. A
+// vertex used by several clusters is stored once per cluster and decodes to
+// the same position in all of them, so the mesh stays watertight. Triangle
+// and vertex normals are octahedral encoded in two 16 bit values. How much
+// memory this saves depends on how many vertices clusters share.
+class CompactMesh final {
+ public:
+  struct Cluster {
+    // vertices of the cluster, a range of all vertices
+    std::uint32_t vertices_begin, vertices_end;
+    // lattice coordinates of the cluster origin
+    std::array<std::uint32_t, 3> offset;
+  };
+
+  // ranges[i] is the triangle range [first, second) of cluster i; every
+  // cluster may reference at most 65536 distinct vertices. vertex_normals
+  // holds a normal per vertex of mesh.
+  CompactMesh(const stl_reader::StlMesh<float, std::size_t>& mesh,
+              std::span<const std::array<std::size_t, 2>> ranges,
+              std::span<const ta::vec3> vertex_normals);
+
+  const Cluster& cluster(std::size_t idx) const noexcept {
+    return clusters_[idx];
+  }
+
+  std::size_t num_vrts() const noexcept { return positions_.size(); }
+
+  ta::vec3 position(const Cluster& cluster, std::size_t vertex) const noexcept {
+    auto&& q = positions_[vertex];
+    // the lattice coordinate is summed as an integer, so it does not depend
+    // on the cluster
+    return ta::vec3(
+        origin_.x() + static_cast<float>(cluster.offset[0] + q[0]) * step_.x(),
+        origin_.y() + static_cast<float>(cluster.offset[1] + q[1]) * step_.y(),
+        origin_.z() + static_cast<float>(cluster.offset[2] + q[2]) * step_.z());
+  }
+
+  // Vertex of a triangle corner, the triangle belongs to cluster.
+  std::size_t corner(const Cluster& cluster, std::size_t tri,
+                     std::size_t corner) const noexcept {
+    return cluster.vertices_begin + corners_[tri][corner];
+  }
+
+  ta::vec3 normal(std::size_t tri) const noexcept;
+  ta::vec3 vertex_normal(std::size_t vertex) const noexcept;
+
+  // Memory held by the mesh.
+  std::size_t bytes() const noexcept;
+
+ private:
+  ta::vec3 origin_{0.f}, step_{0.f};
+  std::vector<Cluster> clusters_;
+  std::vector<std::array<std::uint16_t, 3>> positions_;
+  std::vector<std::array<std::uint16_t, 3>> corners_;
+  std::vector<std::array<std::int16_t, 2>> normals_;
+  std::vector<std::array<std::int16_t, 2>> vertex_normals_;
+};
+
+}  // namespace engine
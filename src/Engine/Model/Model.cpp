@@ -1,7 +1,13 @@
 #include <iostream>
 #include <ranges>
 #include <algorithm>
+#include <cmath>
+#include <limits>
 #include <list>
+#include <chrono>
+#include <iterator>
+#include <stdexcept>
+#include <string>
 
 #include "Model.hpp"
 
@@ -9,43 +15,271 @@ namespace engine {
 
     Model::Model()
         :
-        model_(1.f)
+        model_(1.f),
+        version_(0)
     {
     }
 
     Model::~Model()
     {
+        cancel_load();
     }
 
     void Model::load_from_file(std::string_view strv) {
-        stl_mesh_.read_file(strv.data());
+        cancel_load();
+        paged_.reset();
+        stl_reader::StlMesh<float, std::size_t> mesh;
+        mesh.read_file(strv.data());
+        geometry_ = build_geometry(std::move(mesh), quantize_);
+        version_++;
+    }
+
+    std::shared_future<void> Model::load_async(std::string_view strv) {
+        cancel_load();
+        paged_.reset();
+        geometry_ = {};
+        version_++;
+
+        auto loader = std::make_shared<Loader>();
+        loader_ = loader;
+        load_ = std::async(std::launch::async, [loader, file = std::string(strv),
+                                                quantize = quantize_] {
+            auto cancelled = [&] {
+                if (loader->cancel)
+                    throw std::runtime_error("Loading " + file + " cancelled");
+            };
+
+            if (auto count = binary_stl_size(file)) {
+                std::unique_ptr<PagedTriangle[]> chunk;
+                Cluster cluster{0, 0, 0, empty_box()};
+                auto publish = [&] {
+                    std::lock_guard lock(loader->mutex);
+                    loader->chunks.push_back(std::move(chunk));
+                    loader->clusters.push_back(cluster);
+                    cluster = {0, 0, 0, empty_box()};
+                };
+
+                read_binary_stl(file, *count, [&](std::span<const PagedTriangle> tris) {
+                    cancelled();
+                    for (auto&& tri : tris) {
+                        if (!chunk)
+                            chunk = std::make_unique_for_overwrite<PagedTriangle[]>(kClusterSize);
+                        chunk[cluster.tris_end++] = tri;
+                        for (auto&& v : tri.vertices)
+                            expand(cluster.bounds, v);
+                        if (cluster.tris_end == kClusterSize)
+                            publish();
+                    }
+                });
+                if (cluster.tris_end)
+                    publish();
+            }
+
+            // the indexed mesh shares vertices between triangles, which makes
+            // it cheaper to draw than the chunks; it is built completely here,
+            // so refresh() only has to move it in
+            cancelled();
+            stl_reader::StlMesh<float, std::size_t> mesh;
+            mesh.read_file(file.c_str());
+            cancelled();
+            auto geometry = build_geometry(std::move(mesh), quantize);
+            std::lock_guard lock(loader->mutex);
+            loader->geometry = std::move(geometry);
+        }).share();
+        return load_;
+    }
+
+    void Model::refresh() {
+        if (!loader_)
+            return;
+
+        bool done;
+        {
+            std::lock_guard lock(loader_->mutex);
+            if (!loader_->clusters.empty()) {
+                auto&& bounds = geometry_.bounds;
+                auto&& clusters = geometry_.clusters;
+                for (auto&& cluster : loader_->clusters) {
+                    bounds = clusters.empty() ? cluster.bounds : merge(bounds, cluster.bounds);
+                    clusters.push_back(cluster);
+                }
+                std::ranges::move(loader_->chunks, std::back_inserter(chunks_));
+                loader_->clusters.clear();
+                loader_->chunks.clear();
+                version_++;
+            }
+            if (loader_->geometry) {
+                geometry_ = std::move(*loader_->geometry);
+                loader_->geometry.reset();
+                chunks_.clear();
+                version_++;
+            }
+            // sampled under the lock: once the load has finished, everything
+            // it published has been taken over above
+            done = load_.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }
+        // a failed load keeps what was published, the error is in the future
+        if (done)
+            loader_.reset();
+    }
+
+    bool Model::streamed() const noexcept {
+        return paged_ || !chunks_.empty();
+    }
+
+    const PagedTriangle* Model::triangles(std::size_t cluster) const noexcept {
+        return cluster < chunks_.size() ? chunks_[cluster].get() : nullptr;
+    }
+
+    void Model::cancel_load() {
+        if (loader_)
+            loader_->cancel = true;
+        if (load_.valid())
+            load_.wait();
+        loader_.reset();
+        load_ = {};
+        chunks_.clear();
+    }
+
+    Model::Geometry Model::build_geometry(stl_reader::StlMesh<float, std::size_t> mesh,
+                                          bool quantize) {
+        Geometry geometry;
+        geometry.mesh = std::move(mesh);
+        build_clusters(geometry);
+        build_vertex_normals(geometry);
+        if (quantize)
+            build_compact(geometry);
+        return geometry;
+    }
+
+    void Model::build_clusters(Geometry& geometry) {
+        auto&& mesh = geometry.mesh;
+        auto box = empty_box();
+        for (std::size_t i = 0; i < mesh.num_vrts(); i++)
+            expand(box, mesh.vrt_coords(i));
+        geometry.bounds = mesh.num_vrts() ? box
+                                          : std::array{ta::vec3(0.f), ta::vec3(0.f)};
+
+        geometry.clusters.clear();
+        for (std::size_t solid = 0; solid < mesh.num_solids(); solid++) {
+            auto end = mesh.solid_tris_end(solid);
+            for (auto first = mesh.solid_tris_begin(solid); first < end;
+                 first += kClusterSize) {
+                Cluster cluster{solid, first, std::min(first + kClusterSize, end),
+                                empty_box()};
+                for (auto tri = cluster.tris_begin; tri < cluster.tris_end; tri++)
+                    for (std::size_t corner = 0; corner < 3; corner++)
+                        expand(cluster.bounds, mesh.tri_corner_coords(tri, corner));
+                geometry.clusters.push_back(cluster);
+            }
+        }
+    }
+
+    void Model::build_vertex_normals(Geometry& geometry) {
+        auto&& mesh = geometry.mesh;
+        auto&& normals = geometry.vertex_normals;
+        normals.assign(mesh.num_vrts(), ta::vec3(0.f));
+        for (std::size_t tri = 0; tri < mesh.num_tris(); tri++) {
+            auto vertex = [&](std::size_t corner) {
+                auto a3f = mesh.tri_corner_coords(tri, corner);
+                return ta::vec3(a3f[0], a3f[1], a3f[2]);
+            };
+            // twice the area of the triangle
+            auto cross = ta::cross(vertex(1) - vertex(0), vertex(2) - vertex(0));
+            auto area = std::sqrt(ta::dot(cross, cross));
+            auto a3f = mesh.tri_normal(tri);
+            ta::vec3 normal(a3f[0], a3f[1], a3f[2]);
+            for (std::size_t corner = 0; corner < 3; corner++)
+                normals[mesh.tri_corner_ind(tri, corner)] += normal * area;
+        }
+        for (auto&& normal : normals) {
+            auto length = std::sqrt(ta::dot(normal, normal));
+            if (length > 0.f)
+                normal = normal / length;
+        }
+    }
+
+    void Model::build_compact(Geometry& geometry) {
+        std::vector<std::array<std::size_t, 2>> ranges;
+        for (auto&& cluster : geometry.clusters)
+            ranges.push_back({cluster.tris_begin, cluster.tris_end});
+        geometry.compact = std::make_unique<CompactMesh>(geometry.mesh, ranges,
+                                                         geometry.vertex_normals);
+        geometry.mesh = stl_reader::StlMesh<float, std::size_t>();
+        geometry.vertex_normals = {};
+    }
+
+    void Model::quantize(bool enabled) {
+        quantize_ = enabled;
+        if (quantize_ && !geometry_.compact && !streamed() && !geometry_.clusters.empty()) {
+            build_compact(geometry_);
+            version_++;
+        }
+    }
+
+    const CompactMesh* Model::compact_mesh() const noexcept {
+        return geometry_.compact.get();
+    }
+
+    void Model::load_paged(std::string_view page_file, std::size_t cache_bytes) {
+        cancel_load();
+        paged_ = std::make_unique<PagedMesh>(page_file, cache_bytes);
+        geometry_ = {};
+        geometry_.bounds = paged_->bounds();
+        for (auto&& page : paged_->pages())
+            geometry_.clusters.push_back({0, 0, page.size, page.bounds});
+        version_++;
+    }
+
+    PagedMesh* Model::pages() const noexcept {
+        return paged_.get();
     }
 
     const stl_reader::StlMesh<float, std::size_t>& Model::mesh() {
-        return stl_mesh_;
+        return geometry_.mesh;
+    }
+
+    std::span<const ta::vec3> Model::vertex_normals() const noexcept {
+        return geometry_.vertex_normals;
     }
 
     void Model::load_identity() noexcept
     {
         model_ = ta::mat4(1.f);
+        version_++;
     }
 
     void Model::scale(const ta::vec3& size)
     {
         model_ = ta::scale(model_, size);
+        version_++;
     }
 
     void Model::rotare(const ta::vec3& axis, float angle)
     {
         model_ = ta::rotate(model_, axis, angle);
+        version_++;
     }
 
     void Model::translate(const ta::vec3& offset)
     {
         model_ = ta::translate(model_, offset);
+        version_++;
     }
 
     ta::mat4 Model::mat4() const noexcept {
         return model_;
     }
+
+    std::uint64_t Model::version() const noexcept {
+        return version_ + (paged_ ? paged_->generation() : 0);
+    }
+
+    const std::array<ta::vec3, 2>& Model::bounds() const noexcept {
+        return geometry_.bounds;
+    }
+
+    const std::vector<Model::Cluster>& Model::clusters() const noexcept {
+        return geometry_.clusters;
+    }
 }
\ No newline at end of file
@@ -1,5 +1,13 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
 #include <vector>
 #include <string_view>
 
@@ -8,19 +16,77 @@
 #include <tinyalgebra/math/math.hpp>
 #include <threadpool/threadpool.hpp>
 
+#include "../Utility.hpp"
+#include "CompactMesh.hpp"
+#include "PagedMesh.hpp"
+
 namespace engine {
 
     class Model
     {
     public:
+        // Run of up to kClusterSize consecutive triangles of one solid in file
+        // order, the unit of culling. STL files give no spatial order, so the
+        // bounds of a cluster may span much of the model.
+        struct Cluster {
+            std::size_t solid;
+            std::size_t tris_begin, tris_end;
+            std::array<ta::vec3, 2> bounds;
+        };
+
+        static constexpr std::size_t kClusterSize = 256;
 
         Model();
         ~Model();
 
         void load_from_file(std::string_view file);
+
+        // Loads the file on a background thread and returns at once. Binary
+        // STL files are published progressively: every kClusterSize triangles
+        // read become a cluster that can be drawn, and the indexed mesh
+        // replaces them when the load completes. Load errors are reported
+        // through the returned future.
+        std::shared_future<void> load_async(std::string_view file);
+
+        // Takes over what an asynchronous load published since the last
+        // call. The engine calls it whenever the model is submitted.
+        void refresh();
+
+        // True when the clusters are not ranges of mesh(): paged models and
+        // models still loading, see triangles().
+        bool streamed() const noexcept;
+
+        // Triangles of a cluster published by an unfinished load, nullptr
+        // otherwise.
+        const PagedTriangle* triangles(std::size_t cluster) const noexcept;
+
+        // Streams the mesh from a page file built by PagedMesh::build instead
+        // of loading it, at most cache_bytes of triangles stay in memory.
+        void load_paged(std::string_view page_file, std::size_t cache_bytes);
+
+        // Page source of a paged model, nullptr otherwise. Cluster i of a
+        // paged model is page i.
+        PagedMesh* pages() const noexcept;
         
+        // Indexed mesh, empty for paged and quantized models.
         const stl_reader::StlMesh<float, std::size_t>& mesh();
 
+        // Unit normals of the vertices of mesh(), averaged over the adjacent
+        // triangles weighted by their area. Quantized models keep them in
+        // the compact mesh instead.
+        std::span<const ta::vec3> vertex_normals() const noexcept;
+
+        // Keeps indexed meshes in the quantized CompactMesh form, for the
+        // current mesh and later loads, and releases the full precision one.
+        // Positions are rounded to a step of at most 1/65534 of the model
+        // extent, see CompactMesh. Off by default; turning it off affects
+        // later loads only.
+        void quantize(bool enabled);
+
+        // Quantized mesh when quantize() is on, nullptr otherwise. Cluster i
+        // of the model is cluster i of the compact mesh.
+        const CompactMesh* compact_mesh() const noexcept;
+
         void load_identity() noexcept;
         void scale(const ta::vec3& size);
         void rotare(const ta::vec3& axis, float angle);
@@ -28,10 +94,52 @@ namespace engine {
 
         ta::mat4 mat4() const noexcept; 
 
+        // Bumped on every change of the mesh or the transform, including
+        // pages streamed in.
+        std::uint64_t version() const noexcept;
+
+        // Object space bounding box as {min, max}.
+        const std::array<ta::vec3, 2>& bounds() const noexcept;
+
+        const std::vector<Cluster>& clusters() const noexcept;
+
     private:
-        stl_reader::StlMesh<float, std::size_t> stl_mesh_;
+        // Indexed mesh and everything derived from it. Asynchronous loads
+        // build it on the loading thread, so taking it over is a move.
+        struct Geometry {
+            stl_reader::StlMesh<float, std::size_t> mesh;
+            std::vector<ta::vec3> vertex_normals;
+            std::array<ta::vec3, 2> bounds{ta::vec3(0.f), ta::vec3(0.f)};
+            std::vector<Cluster> clusters;
+            std::unique_ptr<CompactMesh> compact;
+        };
+
+        // State shared with the loading thread.
+        struct Loader {
+            std::mutex mutex;
+            std::vector<std::unique_ptr<PagedTriangle[]>> chunks;
+            std::vector<Cluster> clusters;
+            std::optional<Geometry> geometry;
+            std::atomic<bool> cancel{false};
+        };
 
+        void cancel_load();
+        static Geometry build_geometry(stl_reader::StlMesh<float, std::size_t> mesh,
+                                       bool quantize);
+        static void build_clusters(Geometry& geometry);
+        static void build_vertex_normals(Geometry& geometry);
+        // Replaces the indexed mesh and its vertex normals by the compact mesh.
+        static void build_compact(Geometry& geometry);
+
+        Geometry geometry_;
         ta::mat4 model_;
+        std::uint64_t version_;
+        std::unique_ptr<PagedMesh> paged_;
+        bool quantize_{false};
+
+        std::shared_ptr<Loader> loader_;
+        std::shared_future<void> load_;
+        std::vector<std::unique_ptr<PagedTriangle[]>> chunks_;
     };
 
 }
\ No newline at end of file
@@ -0,0 +1,395 @@
+#include "PagedMesh.hpp"
+
+#include "../Utility.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace engine {
+
+namespace {
+
+constexpr char kMagic[8] = {'3', 'D', 'R', 'P', 'A', 'G', 'E', '1'};
+
+struct FileHeader {
+  char magic[8];
+  std::uint64_t pages;
+  std::uint64_t triangles;
+  std::uint64_t payload;
+  float bounds[6];
+};
+
+struct FilePage {
+  float bounds[6];
+  std::uint64_t first;
+  std::uint32_t size;
+  std::uint32_t reserved;
+};
+
+constexpr std::size_t kStlHeader = 84;
+constexpr std::size_t kStlTriangle = 50;
+
+// Output file of build(), unmapped and closed however build() is left.
+struct OutputFile {
+  int fd{-1};
+  void* map{MAP_FAILED};
+  std::size_t size{0};
+
+  ~OutputFile() {
+    if (map != MAP_FAILED) ::munmap(map, size);
+    if (fd >= 0) ::close(fd);
+  }
+};
+
+template <typename F>
+void for_each_stl_triangle(std::string_view file, std::uint32_t count, F&& f) {
+  read_binary_stl(file, count, [&](std::span<const PagedTriangle> chunk) {
+    for (auto&& tri : chunk) f(tri);
+  });
+}
+
+}  // namespace
+
+std::optional<std::uint32_t> binary_stl_size(std::string_view file) {
+  std::ifstream stream(std::string(file), std::ios::binary | std::ios::ate);
+  if (!stream) throw std::runtime_error("Can't open " + std::string(file));
+  auto file_size = static_cast<std::uintmax_t>(stream.tellg());
+
+  std::uint32_t count = 0;
+  stream.seekg(80);
+  stream.read(reinterpret_cast<char*>(&count), sizeof(count));
+  if (!stream || file_size != kStlHeader + std::uintmax_t(count) * kStlTriangle)
+    return std::nullopt;
+  return count;
+}
+
+void read_binary_stl(
+    std::string_view file, std::uint32_t count,
+    const std::function<void(std::span<const PagedTriangle>)>& f) {
+  std::ifstream stream(std::string(file), std::ios::binary);
+  stream.seekg(kStlHeader);
+
+  constexpr std::size_t kChunk = 4096;
+  std::vector<char> buffer(kChunk * kStlTriangle);
+  std::vector<PagedTriangle> chunk(kChunk);
+  for (std::uint32_t done = 0; done < count;) {
+    auto n = std::min<std::size_t>(kChunk, count - done);
+    if (!stream.read(buffer.data(), n * kStlTriangle))
+      throw std::runtime_error("Unexpected end of " + std::string(file));
+
+    for (std::size_t i = 0; i < n; i++)
+      std::memcpy(&chunk[i], buffer.data() + i * kStlTriangle,
+                  sizeof(PagedTriangle));
+    f(std::span(chunk.data(), n));
+    done += n;
+  }
+}
+
+void PagedMesh::build(std::string_view stl_file, std::string_view page_file,
+                      std::size_t page_size) {
+  auto size = binary_stl_size(stl_file);
+  if (!size)
+    throw std::runtime_error(std::string(stl_file) +
+                             " is not a binary STL file");
+  auto count = *size;
+
+  // pass 1: bounds
+  auto box = empty_box();
+  for_each_stl_triangle(stl_file, count, [&](const PagedTriangle& tri) {
+    for (auto&& v : tri.vertices) expand(box, v);
+  });
+
+  // cells of the grid hold about one page each
+  auto res = static_cast<std::size_t>(
+      std::cbrt(static_cast<double>(count) / static_cast<double>(page_size)));
+  res = std::clamp<std::size_t>(res, 1, 64);
+  auto extent = box[1] - box[0];
+  auto cell_of = [&](const PagedTriangle& tri) {
+    std::size_t cell = 0;
+    std::array<float, 3> lo{box[0].x(), box[0].y(), box[0].z()};
+    std::array<float, 3> size{extent.x(), extent.y(), extent.z()};
+    for (std::size_t k = 0; k < 3; k++) {
+      auto c = (tri.vertices[0][k] + tri.vertices[1][k] + tri.vertices[2][k]) /
+               3.f;
+      auto t = size[k] > 0.f ? (c - lo[k]) / size[k] : 0.f;
+      auto idx = std::clamp<std::size_t>(
+          static_cast<std::size_t>(t * static_cast<float>(res)), 0, res - 1);
+      cell = cell * res + idx;
+    }
+    return cell;
+  };
+
+  // pass 2: triangles per cell
+  std::vector<std::uint64_t> cell_size(res * res * res, 0);
+  for_each_stl_triangle(stl_file, count, [&](const PagedTriangle& tri) {
+    cell_size[cell_of(tri)]++;
+  });
+
+  std::vector<std::uint64_t> cell_first(cell_size.size());
+  std::vector<std::uint64_t> cell_page(cell_size.size());
+  std::vector<Page> pages;
+  for (std::size_t cell = 0, first = 0; cell < cell_size.size(); cell++) {
+    cell_first[cell] = first;
+    cell_page[cell] = pages.size();
+    for (std::uint64_t k = 0; k < cell_size[cell]; k += page_size)
+      pages.push_back(
+          {empty_box(), first + k,
+           static_cast<std::uint32_t>(
+               std::min<std::uint64_t>(page_size, cell_size[cell] - k))});
+    first += cell_size[cell];
+  }
+
+  auto payload = sizeof(FileHeader) + pages.size() * sizeof(FilePage);
+  payload = (payload + 63) & ~std::size_t(63);
+  auto total = payload + std::size_t(count) * sizeof(PagedTriangle);
+
+  OutputFile file;
+  file.fd = ::open(std::string(page_file).c_str(), O_RDWR | O_CREAT | O_TRUNC,
+                   0644);
+  if (file.fd < 0)
+    throw std::runtime_error("Can't create " + std::string(page_file));
+  if (::ftruncate(file.fd, static_cast<off_t>(total)) != 0)
+    throw std::runtime_error("Can't resize " + std::string(page_file));
+  file.map = ::mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    file.fd, 0);
+  if (file.map == MAP_FAILED)
+    throw std::runtime_error("Can't map " + std::string(page_file));
+  file.size = total;
+  auto map = file.map;
+
+  // pass 3: scatter triangles into their cells, the kernel writes the dirty
+  // parts of the mapping back, so the output may exceed memory as well
+  auto out = reinterpret_cast<PagedTriangle*>(static_cast<std::byte*>(map) +
+                                              payload);
+  std::vector<std::uint64_t> cell_fill(cell_size.size(), 0);
+  for_each_stl_triangle(stl_file, count, [&](const PagedTriangle& tri) {
+    auto cell = cell_of(tri);
+    auto k = cell_fill[cell]++;
+    out[cell_first[cell] + k] = tri;
+
+    auto&& page = pages[cell_page[cell] + k / page_size];
+    for (auto&& v : tri.vertices) expand(page.bounds, v);
+  });
+
+  FileHeader header{};
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.pages = pages.size();
+  header.triangles = count;
+  header.payload = payload;
+  header.bounds[0] = box[0].x(), header.bounds[1] = box[0].y();
+  header.bounds[2] = box[0].z(), header.bounds[3] = box[1].x();
+  header.bounds[4] = box[1].y(), header.bounds[5] = box[1].z();
+  std::memcpy(map, &header, sizeof(header));
+
+  auto dir = reinterpret_cast<FilePage*>(static_cast<std::byte*>(map) +
+                                         sizeof(FileHeader));
+  for (auto&& [idx, page] : pages | std::views::enumerate) {
+    FilePage entry{{page.bounds[0].x(), page.bounds[0].y(), page.bounds[0].z(),
+                    page.bounds[1].x(), page.bounds[1].y(), page.bounds[1].z()},
+                   page.first,
+                   page.size,
+                   0};
+    std::memcpy(dir + idx, &entry, sizeof(entry));
+  }
+}
+
+PagedMesh::PagedMesh(std::string_view page_file, std::size_t cache_bytes,
+                     std::size_t threads)
+    : bounds_{ta::vec3(0.f), ta::vec3(0.f)}, cache_bytes_(cache_bytes) {
+  fd_ = ::open(std::string(page_file).c_str(), O_RDONLY);
+  if (fd_ < 0) throw std::runtime_error("Can't open " + std::string(page_file));
+
+  struct stat st;
+  if (::fstat(fd_, &st) != 0 ||
+      static_cast<std::size_t>(st.st_size) < sizeof(FileHeader)) {
+    ::close(fd_);
+    throw std::runtime_error(std::string(page_file) + " is not a page file");
+  }
+
+  map_size_ = static_cast<std::size_t>(st.st_size);
+  auto map = ::mmap(nullptr, map_size_, PROT_READ, MAP_SHARED, fd_, 0);
+  if (map == MAP_FAILED) {
+    ::close(fd_);
+    throw std::runtime_error("Can't map " + std::string(page_file));
+  }
+  map_ = static_cast<const std::byte*>(map);
+
+  FileHeader header;
+  std::memcpy(&header, map_, sizeof(header));
+  auto expected = header.payload + header.triangles * sizeof(PagedTriangle);
+  if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      expected > map_size_) {
+    ::munmap(map, map_size_);
+    ::close(fd_);
+    throw std::runtime_error(std::string(page_file) + " is not a page file");
+  }
+
+  bounds_ = {ta::vec3(header.bounds[0], header.bounds[1], header.bounds[2]),
+             ta::vec3(header.bounds[3], header.bounds[4], header.bounds[5])};
+  triangles_ = reinterpret_cast<const PagedTriangle*>(map_ + header.payload);
+
+  pages_.reserve(header.pages);
+  for (std::size_t idx = 0; idx < header.pages; idx++) {
+    FilePage entry;
+    std::memcpy(&entry, map_ + sizeof(FileHeader) + idx * sizeof(FilePage),
+                sizeof(entry));
+    pages_.push_back(
+        {{ta::vec3(entry.bounds[0], entry.bounds[1], entry.bounds[2]),
+          ta::vec3(entry.bounds[3], entry.bounds[4], entry.bounds[5])},
+         entry.first,
+         entry.size});
+  }
+  slots_.resize(pages_.size());
+
+  for (std::size_t i = 0; i < std::max<std::size_t>(threads, 1); i++)
+    loaders_.emplace_back([this] { loader_loop(); });
+}
+
+PagedMesh::~PagedMesh() {
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (auto&& loader : loaders_) loader.join();
+
+  ::munmap(const_cast<std::byte*>(map_), map_size_);
+  ::close(fd_);
+}
+
+const std::vector<PagedMesh::Page>& PagedMesh::pages() const noexcept {
+  return pages_;
+}
+
+const std::array<ta::vec3, 2>& PagedMesh::bounds() const noexcept {
+  return bounds_;
+}
+
+void PagedMesh::begin_frame() {
+  std::lock_guard lock(mutex_);
+  frame_++;
+
+  // only pages requested by the new frame are worth loading
+  for (; !queue_.empty(); queue_.pop()) {
+    auto&& slot = slots_[queue_.top().second];
+    if (slot.state == State::kQueued) slot.state = State::kAbsent;
+  }
+}
+
+const PagedTriangle* PagedMesh::acquire(std::size_t page, float priority) {
+  std::lock_guard lock(mutex_);
+
+  auto&& slot = slots_[page];
+  if (slot.state == State::kResident) {
+    slot.last_used = frame_;
+    touch(static_cast<std::uint32_t>(page));
+    return slot.data.get();
+  }
+
+  if (slot.state == State::kAbsent) {
+    slot.state = State::kQueued;
+    queue_.emplace(priority, static_cast<std::uint32_t>(page));
+    cv_.notify_one();
+  }
+  return nullptr;
+}
+
+std::uint64_t PagedMesh::generation() const noexcept {
+  return generation_.load();
+}
+
+std::size_t PagedMesh::resident_bytes() const noexcept {
+  std::lock_guard lock(mutex_);
+  return resident_bytes_;
+}
+
+void PagedMesh::loader_loop() {
+  for (;;) {
+    std::uint32_t page;
+    {
+      std::unique_lock lock(mutex_);
+      cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      if (stop_) return;
+
+      page = queue_.top().second;
+      queue_.pop();
+      if (slots_[page].state != State::kQueued) continue;
+      slots_[page].state = State::kLoading;
+    }
+
+    auto&& info = pages_[page];
+    auto bytes = info.size * sizeof(PagedTriangle);
+    auto data = std::make_unique_for_overwrite<PagedTriangle[]>(info.size);
+    auto src = triangles_ + info.first;
+    std::memcpy(data.get(), src, bytes);
+
+    // drop the mapped copy, the cache is the only resident one
+    auto page_size = static_cast<std::uintptr_t>(::sysconf(_SC_PAGESIZE));
+    auto begin = reinterpret_cast<std::uintptr_t>(src);
+    auto first = (begin + page_size - 1) & ~(page_size - 1);
+    auto last = (begin + bytes) & ~(page_size - 1);
+    if (first < last)
+      ::madvise(reinterpret_cast<void*>(first), last - first, MADV_DONTNEED);
+
+    // evicted pages are released outside the lock
+    std::vector<std::unique_ptr<PagedTriangle[]>> freed;
+    {
+      std::lock_guard lock(mutex_);
+      auto&& slot = slots_[page];
+      slot.data = std::move(data);
+      slot.state = State::kResident;
+      slot.last_used = frame_;
+      touch(page);
+      resident_bytes_ += bytes;
+      evict(freed);
+    }
+    generation_++;
+  }
+}
+
+void PagedMesh::touch(std::uint32_t page) noexcept {
+  if (page == lru_tail_) return;
+  auto&& slot = slots_[page];
+  if (slot.prev != kNone || page == lru_head_) unlink(page);
+
+  slot.prev = lru_tail_;
+  slot.next = kNone;
+  if (lru_tail_ != kNone)
+    slots_[lru_tail_].next = page;
+  else
+    lru_head_ = page;
+  lru_tail_ = page;
+}
+
+void PagedMesh::unlink(std::uint32_t page) noexcept {
+  auto&& slot = slots_[page];
+  (slot.prev != kNone ? slots_[slot.prev].next : lru_head_) = slot.next;
+  (slot.next != kNone ? slots_[slot.next].prev : lru_tail_) = slot.prev;
+  slot.prev = slot.next = kNone;
+}
+
+void PagedMesh::evict(std::vector<std::unique_ptr<PagedTriangle[]>>& freed) {
+  // the head is the least recently used page; once it is pinned by the
+  // current frame, so are all others
+  while (resident_bytes_ > cache_bytes_ && lru_head_ != kNone &&
+         slots_[lru_head_].last_used < frame_) {
+    auto page = lru_head_;
+    auto&& slot = slots_[page];
+    unlink(page);
+    freed.push_back(std::move(slot.data));
+    slot.state = State::kAbsent;
+    resident_bytes_ -= pages_[page].size * sizeof(PagedTriangle);
+  }
+}
+
+}  // namespace engine
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <span>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <tinyalgebra/math/math.hpp>
+
+namespace engine {
+
+// Triangle record of a page file.
+struct PagedTriangle {
+  float normal[3];
+  float vertices[3][3];
+};
+
+// Triangle count of a binary STL file, nullopt for other files.
+std::optional<std::uint32_t> binary_stl_size(std::string_view file);
+
+// Streams the triangles of a binary STL file in chunks.
+void read_binary_stl(
+    std::string_view file, std::uint32_t count,
+    const std::function<void(std::span<const PagedTriangle>)>& f);
+
+// Mesh kept in a page file and streamed in on demand.
+//
+// A page file holds triangles bucketed by a uniform grid, so every page is
+// a run of spatially close triangles with its own bounds. The file is memory
+// mapped; background threads copy requested pages into an LRU cache and
+// release the mapped range again, so the resident memory is bounded by the
+// cache size rather than by the mesh size.
+class PagedMesh final {
+ public:
+  // triangles per page
+  static constexpr std::size_t kPageSize = 4096;
+
+  struct Page {
+    std::array<ta::vec3, 2> bounds;
+    std::uint64_t first;
+    std::uint32_t size;
+  };
+
+  // Converts a binary STL file into a page file. Works in three streaming
+  // passes over the input, memory use does not depend on the mesh size.
+  static void build(std::string_view stl_file, std::string_view page_file,
+                    std::size_t page_size = kPageSize);
+
+  // cache_bytes caps the memory of resident pages, pages used by the current
+  // frame are never evicted though.
+  PagedMesh(std::string_view page_file, std::size_t cache_bytes,
+            std::size_t threads = 2);
+  ~PagedMesh();
+
+  PagedMesh(const PagedMesh&) = delete;
+  PagedMesh& operator=(const PagedMesh&) = delete;
+
+  const std::vector<Page>& pages() const noexcept;
+  const std::array<ta::vec3, 2>& bounds() const noexcept;
+
+  // Starts a new frame: pages acquired before may be evicted again and
+  // pages requested but not yet loading are dropped from the queue.
+  void begin_frame();
+
+  // Returns the triangles of a resident page and keeps the page until the
+  // next begin_frame(). Otherwise queues the page for loading, larger
+  // priority first, and returns nullptr.
+  const PagedTriangle* acquire(std::size_t page, float priority);
+
+  // Incremented whenever a page becomes resident.
+  std::uint64_t generation() const noexcept;
+  std::size_t resident_bytes() const noexcept;
+
+ private:
+  enum class State : std::uint8_t { kAbsent, kQueued, kLoading, kResident };
+
+  static constexpr std::uint32_t kNone = ~std::uint32_t(0);
+
+  struct Slot {
+    State state{State::kAbsent};
+    std::uint64_t last_used{0};
+    std::unique_ptr<PagedTriangle[]> data;
+    // neighbours in the LRU list of resident pages
+    std::uint32_t prev{kNone}, next{kNone};
+  };
+
+  void loader_loop();
+  // Moves a resident page to the most recently used end of the LRU list.
+  void touch(std::uint32_t page) noexcept;
+  void unlink(std::uint32_t page) noexcept;
+  // Unlinks least recently used pages not pinned by the current frame
+  // until the cache fits, their data is moved to freed.
+  void evict(std::vector<std::unique_ptr<PagedTriangle[]>>& freed);
+
+  int fd_{-1};
+  const std::byte* map_{nullptr};
+  std::size_t map_size_{0};
+  const PagedTriangle* triangles_{nullptr};
+
+  std::array<ta::vec3, 2> bounds_;
+  std::vector<Page> pages_;
+  std::vector<Slot> slots_;
+  // resident pages, least recently used first; pages are touched when
+  // acquired, so the list is ordered by last_used
+  std::uint32_t lru_head_{kNone}, lru_tail_{kNone};
+
+  std::size_t cache_bytes_;
+  std::size_t resident_bytes_{0};
+  std::uint64_t frame_{1};
+  std::atomic<std::uint64_t> generation_{0};
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::priority_queue<std::pair<float, std::uint32_t>> queue_;
+  bool stop_{false};
+  std::vector<std::thread> loaders_;
+};
+
+}  // namespace engine
@@ -0,0 +1,81 @@
+#include "Occlusion.hpp"
+
+#include <algorithm>
+#include <limits>
+
+namespace engine {
+
+void OcclusionBuffer::resize(std::int32_t width, std::int32_t height) {
+  width_ = (width + kCellSize - 1) / kCellSize;
+  height_ = (height + kCellSize - 1) / kCellSize;
+  depth_.assign(static_cast<std::size_t>(width_ * height_),
+                std::numeric_limits<float>::max());
+}
+
+void OcclusionBuffer::clear() noexcept {
+  std::ranges::fill(depth_, std::numeric_limits<float>::max());
+}
+
+void OcclusionBuffer::rasterize(const std::array<ta::vec2i, 3>& screen,
+                                float zmax) noexcept {
+  auto a = screen[0], b = screen[1], c = screen[2];
+
+  std::int64_t area = std::int64_t(b.x() - a.x()) * (c.y() - a.y()) -
+                      std::int64_t(b.y() - a.y()) * (c.x() - a.x());
+  if (area == 0) return;
+  if (area < 0) std::swap(b, c);
+
+  auto xmin = std::max(std::min({a.x(), b.x(), c.x()}) / kCellSize, 0);
+  auto ymin = std::max(std::min({a.y(), b.y(), c.y()}) / kCellSize, 0);
+  auto xmax = std::min(std::max({a.x(), b.x(), c.x()}) / kCellSize, width_ - 1);
+  auto ymax =
+      std::min(std::max({a.y(), b.y(), c.y()}) / kCellSize, height_ - 1);
+  if (xmin > xmax || ymin > ymax) return;
+
+  // Edge functions e(x, y) = ex * x + ey * y + e0, non-negative inside.
+  // Being linear, over a cell each one is smallest in a known corner, so a
+  // single evaluation per edge decides whether the cell is fully covered.
+  std::array<std::int64_t, 3> ex, ey, e0;
+  std::array<ta::vec2i, 3> from{a, b, c}, to{b, c, a};
+  for (std::size_t i = 0; i < 3; i++) {
+    ex[i] = -(to[i].y() - from[i].y());
+    ey[i] = to[i].x() - from[i].x();
+    e0[i] = -ex[i] * from[i].x() - ey[i] * from[i].y();
+    // move the origin to the minimizing corner of cell (0, 0)
+    e0[i] += (ex[i] < 0 ? ex[i] * (kCellSize - 1) : 0) +
+             (ey[i] < 0 ? ey[i] * (kCellSize - 1) : 0);
+  }
+
+  for (auto cy = ymin; cy <= ymax; cy++) {
+    auto row = depth_.data() + cy * width_;
+    std::int64_t y = cy * kCellSize;
+
+    for (auto cx = xmin; cx <= xmax; cx++) {
+      std::int64_t x = cx * kCellSize;
+      auto w0 = ex[0] * x + ey[0] * y + e0[0];
+      auto w1 = ex[1] * x + ey[1] * y + e0[1];
+      auto w2 = ex[2] * x + ey[2] * y + e0[2];
+      auto covered = (w0 | w1 | w2) >= 0;
+      row[cx] = covered ? std::min(row[cx], zmax) : row[cx];
+    }
+  }
+}
+
+bool OcclusionBuffer::occluded(const ScreenRect& rect,
+                               float zmin) const noexcept {
+  if (rect.empty() || depth_.empty()) return false;
+
+  auto xmin = std::max(rect.xmin / kCellSize, 0);
+  auto ymin = std::max(rect.ymin / kCellSize, 0);
+  auto xmax = std::min(rect.xmax / kCellSize, width_ - 1);
+  auto ymax = std::min(rect.ymax / kCellSize, height_ - 1);
+
+  for (auto cy = ymin; cy <= ymax; cy++) {
+    auto row = depth_.data() + cy * width_;
+    for (auto cx = xmin; cx <= xmax; cx++)
+      if (row[cx] >= zmin) return false;
+  }
+  return true;
+}
+
+}  // namespace engine
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include <tinyalgebra/math/type_decl.hpp>
+
+#include "Utility.hpp"
+
+namespace engine {
+
+// Low resolution depth buffer for occlusion culling. A cell holds the
+// farthest depth of the nearest occluder triangle that covers the whole
+// cell, so anything farther than that in every touched cell is hidden.
+class OcclusionBuffer final {
+ public:
+  // pixels per cell side
+  static constexpr std::int32_t kCellSize = 8;
+
+  void resize(std::int32_t width, std::int32_t height);
+  void clear() noexcept;
+
+  // Conservative rasterization: a cell is written only when all its pixels
+  // are inside the triangle. screen holds viewport coordinates as used by
+  // the main rasterizer, zmax is the farthest ndc depth of the triangle.
+  void rasterize(const std::array<ta::vec2i, 3>& screen, float zmax) noexcept;
+
+  // True when every cell touched by rect holds an occluder nearer than zmin.
+  bool occluded(const ScreenRect& rect, float zmin) const noexcept;
+
+ private:
+  std::int32_t width_{0}, height_{0};
+  std::vector<float> depth_;
+};
+
+}  // namespace engine
@@ -0,0 +1,143 @@
+#include "Scheduler.hpp"
+
+#include <algorithm>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace engine {
+
+Scheduler::Scheduler(std::size_t threads, bool pin) {
+  if (!threads)
+    threads = std::max(std::thread::hardware_concurrency(), 2u) - 1;
+
+  concurrency_ = threads + 1;
+  queues_ = std::make_unique<Queue[]>(concurrency_);
+
+  threads_.reserve(threads);
+  for (std::size_t worker = 1; worker < concurrency_; worker++) {
+    threads_.emplace_back([this, worker] { worker_loop(worker); });
+
+#if defined(__linux__)
+    if (pin) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(worker % std::max(std::thread::hardware_concurrency(), 1u),
+              &set);
+      pthread_setaffinity_np(threads_.back().native_handle(), sizeof(set),
+                             &set);
+    }
+#else
+    (void)pin;
+#endif
+  }
+}
+
+Scheduler::~Scheduler() {
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+
+  for (auto&& thread : threads_) thread.join();
+}
+
+std::size_t Scheduler::concurrency() const noexcept { return concurrency_; }
+
+void Scheduler::dispatch(std::size_t count, const std::uint32_t* order,
+                         Invoke invoke, void* fn) {
+  if (!count) return;
+
+  Batch batch{invoke, fn, count, {}, {}};
+
+  {
+    std::lock_guard lock(mutex_);
+    pending_ += static_cast<std::ptrdiff_t>(count);
+  }
+
+  for (std::size_t worker = 0; worker < concurrency_; worker++) {
+    auto&& queue = queues_[worker];
+    std::lock_guard lock(queue.mutex);
+    for (auto i = worker; i < count; i += concurrency_)
+      queue.tasks.push_back({&batch, order ? order[i] : i});
+  }
+  cv_.notify_all();
+
+  // the caller works as worker 0 until the batch is drained
+  while (batch.remaining.load()) {
+    if (try_run_one(0)) continue;
+
+    auto finished = finished_.load();
+    if (!batch.remaining.load()) break;
+    finished_.wait(finished);
+  }
+
+  if (batch.error) std::rethrow_exception(batch.error);
+}
+
+bool Scheduler::pop(std::size_t worker, Task& task) {
+  {
+    auto&& queue = queues_[worker];
+    std::lock_guard lock(queue.mutex);
+    if (queue.head < queue.tasks.size()) {
+      task = queue.tasks[queue.head++];
+      if (queue.head == queue.tasks.size()) {
+        queue.tasks.clear();
+        queue.head = 0;
+      }
+      return true;
+    }
+  }
+
+  // steal the cheapest job of another worker
+  for (std::size_t i = 1; i < concurrency_; i++) {
+    auto&& queue = queues_[(worker + i) % concurrency_];
+    std::lock_guard lock(queue.mutex);
+    if (queue.head < queue.tasks.size()) {
+      task = queue.tasks.back();
+      queue.tasks.pop_back();
+      if (queue.head == queue.tasks.size()) {
+        queue.tasks.clear();
+        queue.head = 0;
+      }
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool Scheduler::try_run_one(std::size_t worker) {
+  Task task;
+  if (!pop(worker, task)) return false;
+  pending_--;
+
+  auto batch = task.batch;
+  try {
+    batch->invoke(batch->fn, task.job, worker);
+  } catch (...) {
+    if (!batch->failed.test_and_set()) batch->error = std::current_exception();
+  }
+
+  // the batch lives on the submitter's stack, do not touch it afterwards
+  if (batch->remaining.fetch_sub(1) == 1) {
+    finished_++;
+    finished_.notify_all();
+  }
+  return true;
+}
+
+void Scheduler::worker_loop(std::size_t worker) {
+  for (;;) {
+    if (try_run_one(worker)) continue;
+
+    std::unique_lock lock(mutex_);
+    cv_.wait(lock, [this] { return stop_ || pending_.load() > 0; });
+    if (stop_) return;
+  }
+}
+
+}  // namespace engine
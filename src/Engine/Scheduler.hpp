@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace engine {
+
+// Work-stealing job scheduler shared by the whole application.
+//
+// Every worker owns a job deque. A batch is spread round-robin over the
+// deques in the given order; owners take jobs from the front, so the jobs
+// listed first start first, and idle workers steal from the back of other
+// deques. The calling thread takes part as worker 0 and run() returns when
+// the whole batch is done. Only one thread may submit at a time and jobs
+// must not submit nested batches.
+class Scheduler final {
+ public:
+  // threads == 0 sizes the pool from the hardware concurrency. With pin set
+  // every worker thread is bound to its own core.
+  explicit Scheduler(std::size_t threads = 0, bool pin = false);
+  ~Scheduler();
+
+  Scheduler(const Scheduler&) = delete;
+  Scheduler& operator=(const Scheduler&) = delete;
+
+  // Number of worker slots, the calling thread included. Worker indices
+  // passed to jobs are below this value.
+  std::size_t concurrency() const noexcept;
+
+  // Calls job(i, worker) for every i in [0, count).
+  template <typename F>
+  void run(std::size_t count, F&& job) {
+    dispatch(count, nullptr, &invoke<std::remove_reference_t<F>>, &job);
+  }
+
+  // Calls job(i, worker) for every i in order; jobs listed first start first,
+  // so heavy jobs should come first.
+  template <typename F>
+  void run(std::span<const std::uint32_t> order, F&& job) {
+    dispatch(order.size(), order.data(), &invoke<std::remove_reference_t<F>>,
+             &job);
+  }
+
+ private:
+  using Invoke = void (*)(void* fn, std::size_t job, std::size_t worker);
+
+  struct Batch {
+    Invoke invoke;
+    void* fn;
+    std::atomic<std::size_t> remaining;
+    std::atomic_flag failed;
+    std::exception_ptr error;
+  };
+
+  struct Task {
+    Batch* batch;
+    std::size_t job;
+  };
+
+  struct alignas(64) Queue {
+    std::mutex mutex;
+    std::vector<Task> tasks;
+    std::size_t head{0};
+  };
+
+  template <typename F>
+  static void invoke(void* fn, std::size_t job, std::size_t worker) {
+    (*static_cast<F*>(fn))(job, worker);
+  }
+
+  void dispatch(std::size_t count, const std::uint32_t* order, Invoke invoke,
+                void* fn);
+  bool pop(std::size_t worker, Task& task);
+  bool try_run_one(std::size_t worker);
+  void worker_loop(std::size_t worker);
+
+  std::size_t concurrency_;
+  std::unique_ptr<Queue[]> queues_;
+  std::vector<std::thread> threads_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::atomic<std::ptrdiff_t> pending_{0};
+  std::atomic<std::uint32_t> finished_{0};
+  bool stop_{false};
+};
+
+}  // namespace engine
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+
 #include <tinyalgebra/math/math.hpp>
 
 namespace engine {
@@ -9,8 +11,14 @@ class IShader {
   IShader() = default;
   virtual ~IShader() = default;
 
+  // May be called from several scheduler workers at once.
   virtual ta::vec4 Vertex(ta::vec3 pos) = 0;
   virtual ta::vec4 Fragment() = 0;
+
+  // Hash of the uniform state Vertex() depends on. The engine compares it
+  // between frames to skip redrawing unchanged models, so shaders with
+  // different transforms must not hash equal.
+  virtual std::uint64_t state_hash() const noexcept = 0;
 };
 
 }  // namespace engine
\ No newline at end of file
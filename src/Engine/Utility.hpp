@@ -1,20 +1,183 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cmath>
 #include <concepts>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
 #include <numeric>
-#include <queue>
 #include <tuple>
+#include <type_traits>
 #include <vector>
 
 #include <tinyalgebra/math/type_decl.hpp>
 
 #include <cassert>
 
+#include "Arena.hpp"
+
 namespace engine {
 
-using Tile = ta::vec2;
-using TileQueue = std::queue<Tile>;
-using TileQueueGrid = std::vector<TileQueue>;
+// Inclusive pixel rectangle; empty when min exceeds max on either axis.
+struct ScreenRect {
+  std::int32_t xmin{0}, ymin{0}, xmax{-1}, ymax{-1};
+
+  bool empty() const noexcept { return xmin > xmax || ymin > ymax; }
+
+  std::int64_t area() const noexcept {
+    return empty() ? 0
+                   : static_cast<std::int64_t>(xmax - xmin + 1) *
+                         (ymax - ymin + 1);
+  }
+};
+
+// Depth of a triangle as a function of the pixel position.
+struct DepthPlane {
+  float z0, dzdx, dzdy;
+  std::int32_t x0, y0;
+
+  float at(std::int32_t x, std::int32_t y) const noexcept {
+    return z0 + dzdx * static_cast<float>(x - x0) +
+           dzdy * static_cast<float>(y - y0);
+  }
+
+  // Bounds of at() over a rectangle: the extremes of a plane are at the
+  // corners, widened by the rounding error of at().
+  float min(const ScreenRect& r) const noexcept {
+    return std::min({at(r.xmin, r.ymin), at(r.xmax, r.ymin),
+                     at(r.xmin, r.ymax), at(r.xmax, r.ymax)}) -
+           error(r);
+  }
+  float max(const ScreenRect& r) const noexcept {
+    return std::max({at(r.xmin, r.ymin), at(r.xmax, r.ymin),
+                     at(r.xmin, r.ymax), at(r.xmax, r.ymax)}) +
+           error(r);
+  }
+
+ private:
+  float error(const ScreenRect& r) const noexcept {
+    auto dx = static_cast<float>(std::max(std::abs(r.xmin - x0),
+                                          std::abs(r.xmax - x0)));
+    auto dy = static_cast<float>(std::max(std::abs(r.ymin - y0),
+                                          std::abs(r.ymax - y0)));
+    return 4.f * std::numeric_limits<float>::epsilon() *
+           (std::abs(z0) + std::abs(dzdx) * dx + std::abs(dzdy) * dy);
+  }
+};
+
+// Triangle after vertex processing, culling and viewport transform; all the
+// rasterizer needs. Lives in the frame arena.
+struct TriangleSetup {
+  // world space corners and normal for per pixel lighting, and the
+  // reciprocal clip w of the corners to interpolate the corners with
+  std::array<ta::vec3, 3> world;
+  std::array<float, 3> inv_w;
+  std::array<ta::vec2i, 3> screen;
+  ta::vec3 normal;
+  ScreenRect bounds;
+  DepthPlane depth;
+  // lighting at the corners for flat and Gouraud shading
+  std::array<float, 3> light;
+  // side in pixels of the blocks shaded at once: 1, 2 or 4
+  std::uint8_t shading_rate;
+};
+
+// Fixed-size block of a tile bin, chunks of one bin form a linked list.
+struct BinChunk {
+  static constexpr std::size_t kCapacity = 62;
+
+  BinChunk* next;
+  std::uint32_t size;
+  const TriangleSetup* tris[kCapacity];
+};
+
+// Triangles overlapping a tile in submission order. Chunks come from the
+// frame arena, so clear() just forgets them.
+struct TileBin {
+  BinChunk* head{nullptr};
+  BinChunk* tail{nullptr};
+  std::uint32_t size{0};
+
+  void clear() noexcept {
+    head = tail = nullptr;
+    size = 0;
+  }
+
+  void push(Arena& arena, const TriangleSetup* tri) {
+    if (!tail || tail->size == BinChunk::kCapacity) {
+      auto chunk = arena.allocate<BinChunk>();
+      chunk->next = nullptr;
+      chunk->size = 0;
+      (tail ? tail->next : head) = chunk;
+      tail = chunk;
+    }
+    tail->tris[tail->size++] = tri;
+    size++;
+  }
+
+  template <typename F>
+  void for_each(F&& f) const {
+    for (auto chunk = head; chunk; chunk = chunk->next)
+      for (std::uint32_t i = 0; i < chunk->size; i++) f(*chunk->tris[i]);
+  }
+};
+
+// Rendered image, rgb floats with rows bottom-up.
+struct Image {
+  std::size_t width{0}, height{0};
+  std::vector<float> color;
+};
+
+// Axis aligned box as {min, max} that contains nothing.
+inline std::array<ta::vec3, 2> empty_box() noexcept {
+  return {ta::vec3(std::numeric_limits<float>::max()),
+          ta::vec3(std::numeric_limits<float>::lowest())};
+}
+
+// Grows a box to contain the point p[0..2].
+inline void expand(std::array<ta::vec3, 2>& box, const float* p) noexcept {
+  box[0] = ta::vec3(std::min(box[0].x(), p[0]), std::min(box[0].y(), p[1]),
+                    std::min(box[0].z(), p[2]));
+  box[1] = ta::vec3(std::max(box[1].x(), p[0]), std::max(box[1].y(), p[1]),
+                    std::max(box[1].z(), p[2]));
+}
+
+inline std::array<ta::vec3, 2> merge(
+    const std::array<ta::vec3, 2>& a,
+    const std::array<ta::vec3, 2>& b) noexcept {
+  auto box = a;
+  expand(box, std::array{b[0].x(), b[0].y(), b[0].z()}.data());
+  expand(box, std::array{b[1].x(), b[1].y(), b[1].z()}.data());
+  return box;
+}
+
+inline ScreenRect merge(const ScreenRect& a, const ScreenRect& b) noexcept {
+  if (a.empty()) return b;
+  if (b.empty()) return a;
+  return {std::min(a.xmin, b.xmin), std::min(a.ymin, b.ymin),
+          std::max(a.xmax, b.xmax), std::max(a.ymax, b.ymax)};
+}
+
+inline ScreenRect intersect(const ScreenRect& a, const ScreenRect& b) noexcept {
+  return {std::max(a.xmin, b.xmin), std::max(a.ymin, b.ymin),
+          std::min(a.xmax, b.xmax), std::min(a.ymax, b.ymax)};
+}
+
+// FNV-1a over the object representation. Used to detect unchanged scene
+// state between frames, so only trivially copyable values are accepted.
+template <typename T>
+  requires std::is_trivially_copyable_v<T>
+std::uint64_t hash_value(
+    const T& value, std::uint64_t seed = 14695981039346656037ull) noexcept {
+  auto bytes = reinterpret_cast<const unsigned char*>(&value);
+  for (std::size_t i = 0; i < sizeof(T); i++) {
+    seed ^= bytes[i];
+    seed *= 1099511628211ull;
+  }
+  return seed;
+}
 
 // non-owning multidimention view
 template <typename T, std::size_t Dims>
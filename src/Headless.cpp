@@ -0,0 +1,164 @@
+#include "Headless.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <numbers>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <tinyalgebra/Camera.hpp>
+#include <tinyalgebra/math/math.hpp>
+
+#include "Engine/Engine.hpp"
+#include "Engine/ImageWriter.hpp"
+#include "Engine/Model/Model.hpp"
+#include "Engine/Scheduler.hpp"
+#include "Engine/Shader.hpp"
+#include "Engine/Utility.hpp"
+
+namespace {
+
+class ViewShader : public engine::IShader {
+ public:
+  explicit ViewShader(const ta::mat4& transform) : transform_(transform) {}
+
+  ta::vec4 Vertex(ta::vec3 pos) override {
+    return transform_ * ta::vec4(pos, 1.f);
+  }
+  ta::vec4 Fragment() override { return ta::vec4(); }
+
+  std::uint64_t state_hash() const noexcept override {
+    return engine::hash_value(transform_);
+  }
+
+ private:
+  ta::mat4 transform_;
+};
+
+void render(int argc, char* args[]) {
+  std::filesystem::path out_dir(args[3]);
+  std::size_t count = std::stoul(args[4]);
+  std::size_t width = argc > 5 ? std::stoul(args[5]) : 512;
+  std::size_t height = argc > 6 ? std::stoul(args[6]) : width;
+  std::string extension = argc > 7 ? args[7] : "ppm";
+  if (extension != "ppm" && extension != "png")
+    throw std::invalid_argument("Unknown image format " + extension);
+  std::string shading = argc > 8 ? args[8] : "gouraud";
+
+  engine::Scheduler scheduler;
+  engine::Engine engine(scheduler, 16);
+  engine.resize(width, height);
+  engine.viewport(0, 0, static_cast<std::int32_t>(width),
+                  static_cast<std::int32_t>(height));
+  // vrs shades per pixel at up to 4x4 pixels per lighting evaluation
+  using ShadingMode = engine::Engine::ShadingMode;
+  if (shading == "flat") {
+    engine.shading_mode(ShadingMode::kFlat);
+  } else if (shading == "gouraud") {
+    engine.shading_mode(ShadingMode::kGouraud);
+  } else if (shading == "pixel" || shading == "vrs") {
+    engine.shading_mode(ShadingMode::kPixel);
+    if (shading == "vrs")
+      engine.shading_rate(engine::Engine::ShadingRate::k4x4);
+  } else {
+    throw std::invalid_argument("Unknown shading " + shading);
+  }
+
+  engine::Model model;
+  model.load_from_file(args[2]);
+
+  // The model is centered at the origin and the camera circles it around
+  // y; the light stays above the model, so every view shares its lighting.
+  auto&& [bmin, bmax] = model.bounds();
+  auto extent = bmax - bmin;
+  auto radius = std::max(std::sqrt(ta::dot(extent, extent)) * .5f, 1e-3f);
+  model.translate(-(bmin + bmax) * .5f);
+  engine.light_position(ta::vec3(0.f, radius * 2.f, 0.f));
+
+  auto projection =
+      ta::perspective(ta::rad(60.f), float(width) / float(height),
+                      radius * .1f, radius * 4.f);
+
+  std::vector<ViewShader> shaders;
+  shaders.reserve(count);
+  std::vector<engine::Engine::View> views;
+  for (std::size_t i = 0; i < count; i++) {
+    auto angle = 2.f * std::numbers::pi_v<float> * float(i) / float(count);
+    ta::Camera camera(ta::vec3(radius * 2.f * std::cos(angle), 0.f,
+                               radius * 2.f * std::sin(angle)),
+                      ta::vec3(0.f, 0.f, 0.f), ta::vec3(0.f, 1.f, 0.f));
+    shaders.emplace_back(projection * camera.get_view() * model.mat4());
+    views.push_back({&shaders.back(), camera.position()});
+  }
+
+  // views are rendered in batches, so encoding a batch overlaps rendering
+  // the next one; the writer holds two batches of buffers
+  std::size_t batch = std::min<std::size_t>(count, 8);
+  engine::ImageWriter writer(2 * batch);
+  std::filesystem::create_directories(out_dir);
+
+  std::vector<engine::Image> images;
+  images.reserve(batch);
+  std::chrono::duration<double> render_seconds{0.};
+  auto begin = std::chrono::steady_clock::now();
+  for (std::size_t first = 0; first < count; first += batch) {
+    auto size = std::min(batch, count - first);
+    images.clear();
+    for (std::size_t i = 0; i < size; i++) images.push_back(writer.acquire());
+
+    auto render_begin = std::chrono::steady_clock::now();
+    engine.render_views(model, std::span(views).subspan(first, size), images);
+    render_seconds += std::chrono::steady_clock::now() - render_begin;
+
+    for (std::size_t i = 0; i < size; i++)
+      writer.submit(
+          std::move(images[i]),
+          out_dir / std::format("view_{:04}.{}", first + i, extension));
+  }
+  writer.finish();
+  std::chrono::duration<double> seconds =
+      std::chrono::steady_clock::now() - begin;
+
+  auto stats = writer.stats();
+  auto rate = [](double amount, double seconds) {
+    return seconds > 0. ? amount / seconds : 0.;
+  };
+  std::cout << std::format("{} views of {}x{} in {:.3f} s, {:.1f} images/s",
+                           count, width, height, seconds.count(),
+                           rate(double(count), seconds.count()))
+            << std::endl;
+  std::cout << std::format(
+                   "rendering {:.3f} s, encoding {:.3f} s of encoder time "
+                   "at {:.1f} MB/s, {} stalls on full queue",
+                   render_seconds.count(), stats.encode_seconds,
+                   rate(double(stats.bytes) / 1e6, stats.encode_seconds),
+                   stats.stalls)
+            << std::endl;
+}
+
+}  // namespace
+
+int render_views(int argc, char* args[]) {
+  if (argc < 5) {
+    std::cerr << "usage: " << args[0]
+              << " --render-views model.stl out_dir views [width [height "
+                 "[ppm|png [gouraud|flat|pixel|vrs]]]]"
+              << std::endl;
+    return 1;
+  }
+
+  try {
+    render(argc, args);
+  } catch (std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
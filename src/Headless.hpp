@@ -0,0 +1,8 @@
+#pragma once
+
+// Renders a turntable of a model without a window and writes the views as
+// PPM or PNG images:
+//   --render-views model.stl out_dir views [width [height [ppm|png]]]
+// Views are rendered in engine batches while earlier batches are encoded in
+// the background; prints images per second and the encoder throughput.
+int render_views(int argc, char* args[]);
@@ -1,8 +1,23 @@
 #include "App.hpp"
+#include "Headless.hpp"
 
 int main(int argc, char* args[]) {
-  App app(argc, args);
-  app.run();
+  if (argc > 1 && std::string_view(args[1]) == "--render-views")
+    return render_views(argc, args);
+
+  // missing or malformed model files, page files and cache sizes
+  try {
+    if (argc == 4 && std::string_view(args[1]) == "--build-pages") {
+      engine::PagedMesh::build(args[2], args[3]);
+      return 0;
+    }
+
+    App app(argc, args);
+    app.run();
+  } catch (std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
 
   return 0;
 }
\ No newline at end of file